@@ -0,0 +1,250 @@
+#include "hybrid_renderer.h"
+
+#include "utils/resource_utils.h"
+
+#include <chrono>
+#include <iostream>
+
+
+void cg::renderer::hybrid_renderer::init()
+{
+    model = std::make_shared<cg::world::model>();
+    model->load_obj(settings->model_path);
+
+    camera = std::make_shared<cg::world::camera>();
+    camera->set_width(static_cast<float>(settings->width));
+    camera->set_height(static_cast<float>(settings->height));
+    camera->set_position(float3{
+        settings->camera_position[0],
+        settings->camera_position[1],
+        settings->camera_position[2],
+    });
+    camera->set_theta(settings->camera_theta);
+    camera->set_phi(settings->camera_phi);
+    // Primary rays of the Raytracing target step by the unit right and up vectors over
+    // [-1, 1] vertically, a 90 degree angle of view whatever the setting: the G-buffer
+    // frames the image the same way, and pixel_spread below assumes it
+    camera->set_angle_of_view(90.f);
+    camera->set_z_near(settings->camera_z_near);
+    camera->set_z_far(settings->camera_z_far);
+
+    render_target = std::make_shared<cg::resource<cg::unsigned_color>>(
+        settings->width, settings->height
+    );
+    gbuffer = std::make_shared<cg::renderer::gbuffer>(settings->width, settings->height);
+
+    rasterizer = std::make_shared<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>>();
+    rasterizer->set_render_target(render_target, gbuffer->depth);
+    rasterizer->set_viewport(settings->width, settings->height);
+    rasterizer->set_lod_threshold(settings->lod_threshold);
+    rasterizer->set_gbuffer(gbuffer);
+
+    // Built once: the scene is static, and secondary rays are all this target traces
+    reflection_raytracer = std::make_shared<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>>();
+    reflection_raytracer->set_vertex_buffers(model->get_vertex_buffers());
+    reflection_raytracer->set_index_buffers(model->get_index_buffers());
+    reflection_raytracer->set_lods(model->get_lods());
+    reflection_raytracer->set_lod_threshold(settings->lod_threshold);
+    reflection_raytracer->build_acceleration_structure();
+
+    shadow_raytracer = std::make_shared<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>>();
+    shadow_raytracer->set_lod_threshold(settings->lod_threshold);
+    shadow_raytracer->acceleration_structures = reflection_raytracer->acceleration_structures;
+    shadow_raytracer->lod_acceleration_structures = reflection_raytracer->lod_acceleration_structures;
+    shadow_raytracer->lod_errors = reflection_raytracer->lod_errors;
+
+    // Same light as the Raytracing target
+    lights.push_back({
+        float3{ 0, 1.58f, -0.03f },
+        float3{ 0.78f, 0.78f, 0.78f },
+    });
+}
+
+void cg::renderer::hybrid_renderer::destroy() {}
+
+void cg::renderer::hybrid_renderer::update() {}
+
+void cg::renderer::hybrid_renderer::render()
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    float4x4 matrix = mul(
+        camera->get_projection_matrix(),
+        camera->get_view_matrix(),
+        model->get_world_matrix()
+    );
+
+    // G-buffer pass, the material id is the shape id
+    rasterizer->clear_render_target({});
+    using layout = cg::vertex_layout<cg::vertex>;
+    using gbuffer_layout = cg::join_layouts_t<layout::normal, layout::diffuse>;
+    auto vertex_shader = [&](float4 vertex, const cg::vertex& vertex_data) {
+        return std::make_pair(mul(matrix, vertex), vertex_data);
+    };
+    auto frustum = cg::world::frustum::from_matrix(matrix);
+    for (size_t shape_id = 0; shape_id < model->get_index_buffers().size(); ++shape_id) {
+        const auto& bounding_sphere = model->get_bounding_spheres()[shape_id];
+        if (!frustum.intersects(bounding_sphere) ||
+            !frustum.intersects(model->get_bounding_boxes()[shape_id])) {
+            continue;
+        }
+        auto pipeline = cg::renderer::make_pipeline_state<gbuffer_layout>(
+            vertex_shader,
+            [shape_id](const cg::vertex& vertex_data, const float z) {
+                return cg::renderer::gbuffer_sample{
+                    normalize(float3{ vertex_data.nx, vertex_data.ny, vertex_data.nz }),
+                    float3{ vertex_data.diffuse_r, vertex_data.diffuse_g, vertex_data.diffuse_b },
+                    static_cast<unsigned int>(shape_id)
+                };
+            }
+        );
+        const auto& lods = model->get_lods()[shape_id];
+        const auto& lod = lods[rasterizer->select_lod(lods, bounding_sphere, matrix)];
+        rasterizer->set_vertex_buffer(model->get_vertex_buffers()[shape_id]);
+        rasterizer->set_index_buffer(lod.meshlet_indexes);
+        rasterizer->draw_meshlets(pipeline, lod.meshlets, *lod.meshlet_vertices, matrix);
+    }
+    // The ray pass reads the G-buffer outside of the rasterizer
+    rasterizer->flush();
+
+    auto raster_end = std::chrono::high_resolution_clock::now();
+
+    // Width of a pixel per unit of distance, as for the primary rays of the Raytracing target
+    float pixel_spread = 2.0f / static_cast<float>(settings->height);
+
+    shadow_raytracer->miss_shader = [](const ray& ray) {
+        payload payload{};
+        payload.t = -1.0f;
+        return payload;
+    };
+    shadow_raytracer->any_hit_shader = [](
+            const ray& ray,
+            payload& payload,
+            const triangle<cg::vertex>& triangle)
+    {
+        return payload;
+    };
+
+    // Lighting of the Raytracing target's closest hit shader
+    auto direct_light = [&](float3 position, float3 normal, float3 diffuse, float footprint) {
+        float3 result_color = { 0.0f, 0.0f, 0.0f };
+        for (auto& light : lights) {
+            cg::renderer::ray to_light(position, light.position - position);
+            to_light.footprint = footprint;
+
+            auto shadow_payload = shadow_raytracer->trace_ray(
+                to_light, 1, length(light.position - position)
+            );
+            if (shadow_payload.t >= 0.0f) {
+                continue;
+            }
+            result_color +=
+                diffuse *
+                (light.color / 2) *
+                std::max(dot(normal, to_light.direction), 0.0f);
+        }
+        return result_color;
+    };
+
+    auto sky = [](const ray& ray) {
+        payload payload{};
+        payload.color = { 0.0f, 0.0f, (ray.direction.y + 1.0f) * 0.5f };
+        return payload;
+    };
+    reflection_raytracer->miss_shader = sky;
+    reflection_raytracer->closest_hit_shader = [&](const ray& ray,
+            payload& payload,
+            const triangle<cg::vertex>& triangle,
+            size_t depth)
+    {
+        float3 position = ray.position + ray.direction * payload.t;
+        float3 normal = normalize(
+            payload.bary.x * triangle.na +
+            payload.bary.y * triangle.nb +
+            payload.bary.z * triangle.nc
+        );
+        payload.color = cg::color::from_float3(
+            direct_light(position, normal, triangle.diffuse, ray.footprint_at(payload.t)));
+        return payload;
+    };
+
+    // The G-buffer surfaces are exactly where the primary rays would have hit
+    float4x4 inverted_matrix = inverse(matrix);
+    auto unproject = [&](size_t x, size_t y, float depth) {
+        float4 position = mul(inverted_matrix, float4{
+            2.f * x / settings->width - 1.f,
+            1.f - 2.f * y / settings->height,
+            depth,
+            1.f
+        });
+        return float3{ position.x, position.y, position.z } / position.w;
+    };
+
+    // The Raytracing target sums sqrt(color / accumulation_num) over its frames, every
+    // frame sees the same surfaces here
+    float frames = static_cast<float>(std::max(settings->accumulation_num, 1u));
+    auto output_transfer = [frames](float3 color) {
+        return frames * sqrt(color / frames);
+    };
+
+    constexpr float ray_offset = 2e-3f;
+    float reflectivity = settings->reflectivity;
+    long long shadow_rays = 0;
+    long long reflection_rays = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+ : shadow_rays, reflection_rays)
+    for (int y = 0; y < static_cast<int>(settings->height); ++y) {
+        for (size_t x = 0; x < settings->width; ++x) {
+            float3 near_position = unproject(x, y, 0.f);
+            unsigned int material_id = gbuffer->material_id->item(x, y);
+            if (material_id == cg::renderer::gbuffer::empty_material) {
+                float3 far_position = unproject(x, y, 1.f);
+                ray view_ray(near_position, far_position - near_position);
+                render_target->item(x, y) = cg::unsigned_color::from_float3(
+                    output_transfer(sky(view_ray).color.to_float3()));
+                continue;
+            }
+
+            float3 view_direction = normalize(unproject(x, y, 1.f) - near_position);
+            float3 normal = gbuffer->normal->item(x, y);
+            if (dot(normal, view_direction) > 0.f) {
+                normal = -normal;
+            }
+            // Depth reconstruction error grows with distance, secondary rays start
+            // above the surface instead of relying on min_t alone
+            float3 position = unproject(x, y, gbuffer->depth->item(x, y));
+            float distance = length(position - near_position);
+            position += normal * (ray_offset * distance);
+            // Secondary rays keep the width of the pixel cone at the surface
+            float footprint = pixel_spread * distance;
+
+            float3 result_color = cg::color::from_float3(
+                direct_light(position, normal, gbuffer->albedo->item(x, y), footprint)).to_float3();
+            shadow_rays += static_cast<long long>(lights.size());
+
+            if (reflectivity > 0.f) {
+                ray reflection_ray(position, view_direction - 2.f * dot(view_direction, normal) * normal);
+                reflection_ray.footprint = footprint;
+                reflection_ray.spread = pixel_spread;
+                auto reflection = reflection_raytracer->trace_ray(reflection_ray, 1);
+                result_color = (1.f - reflectivity) * result_color + reflectivity * reflection.color.to_float3();
+                ++reflection_rays;
+                if (reflection.t > 0.f) {
+                    shadow_rays += static_cast<long long>(lights.size());
+                }
+            }
+
+            render_target->item(x, y) = cg::unsigned_color::from_float3(output_transfer(result_color));
+        }
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<float, std::milli> raster_duration = raster_end - start;
+    std::chrono::duration<float, std::milli> raytracing_duration = end - raster_end;
+    std::cout << "G-buffer rasterization took " << raster_duration.count() << " ms, "
+              << "secondary rays took " << raytracing_duration.count() << " ms" << std::endl;
+    std::cout << "Shadow rays: " << shadow_rays
+              << ", reflection rays: " << reflection_rays << std::endl;
+
+    cg::utils::save_resource(*render_target, settings->result_path);
+}
@@ -0,0 +1,31 @@
+#include "renderer/rasterizer/rasterizer.h"
+#include "renderer/raytracer/raytracer.h"
+#include "renderer/renderer.h"
+#include "resource.h"
+
+
+namespace cg::renderer
+{
+    // Primary visibility rasterized into a G-buffer, then only secondary rays
+    // (shadows and one-bounce reflections) traced from the G-buffer surfaces
+    class hybrid_renderer : public renderer
+    {
+    public:
+        virtual void init();
+        virtual void destroy();
+
+        virtual void update();
+        virtual void render();
+
+    protected:
+        std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
+        std::shared_ptr<cg::renderer::gbuffer> gbuffer;
+
+        std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>> rasterizer;
+        // Shares the acceleration structures of reflection_raytracer, stops at any hit
+        std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> shadow_raytracer;
+        std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> reflection_raytracer;
+
+        std::vector<cg::renderer::light> lights;
+    };
+}// namespace cg::renderer
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "renderer/rasterizer/rasterizer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <vector>
+
+
+namespace cg::renderer
+{
+    // Draw recorded into a command list, replayed by command_queue::submit
+    template<typename VB>
+    struct draw_command
+    {
+        // Pipeline id in the high half, view depth in the low half: sorting groups
+        // the draws by pipeline state and orders every group front to back
+        uint64_t sort_key;
+        size_t pipeline_id;
+        // View depth of the nearest point, not below 0
+        float depth;
+        draw_call<VB> call;
+        // Culled at replay against the Hi-Z of the draws replayed before, nullptr for plain draws
+        const cg::world::meshlet* meshlet;
+    };
+
+    // Draws recorded without touching the rasterizer, so every thread can record its own list
+    template<typename VB>
+    class command_list
+    {
+    public:
+        void set_vertex_buffer(std::shared_ptr<resource<VB>> in_vertex_buffer);
+        void set_index_buffer(std::shared_ptr<resource<unsigned int>> in_index_buffer);
+
+        // Depth is the view depth of the nearest point of the draw
+        void draw(size_t pipeline_id, size_t num_vertexes, size_t vertex_offset, float depth);
+        // The meshlet must outlive the replay. The current index buffer indexes vertex_list,
+        // see rasterizer::draw_meshlets
+        void draw_meshlet(
+                size_t pipeline_id, const cg::world::meshlet& meshlet,
+                std::shared_ptr<resource<unsigned int>> vertex_list, float depth);
+
+        void reset();
+        const std::vector<draw_command<VB>>& get_commands() const;
+
+    protected:
+        std::shared_ptr<resource<VB>> vertex_buffer;
+        std::shared_ptr<resource<unsigned int>> index_buffer;
+        std::vector<draw_command<VB>> commands;
+    };
+
+    // Pipeline states the command lists refer to, and the replay of their draws
+    template<typename VB, typename RT>
+    class command_queue
+    {
+    public:
+        // The returned id records draws with the pipeline; lower ids are replayed first
+        template<typename Pipeline>
+        size_t add_pipeline(const Pipeline& pipeline, depth_func depth_comparison = depth_func::less);
+
+        // Merges and sorts the draws of all lists, then replays every run of draws
+        // with the same pipeline as batches on the tile-parallel backend. Meshlets
+        // go through the culling of draw_meshlets first, against the Hi-Z left by the
+        // batches before theirs: a run is split where its draws get twice as far as
+        // the nearest of the batch, once the batch holds min_batch_draws
+        void submit(
+                rasterizer<VB, RT>& target, const std::vector<command_list<VB>>& lists,
+                const float4x4& matrix);
+
+        size_t get_batch_count() const;
+
+        static constexpr size_t min_batch_draws = 64;
+        static constexpr float batch_depth_ratio = 2.f;
+
+    protected:
+        struct pipeline_entry
+        {
+            depth_func depth_comparison;
+            // The only type-erased call of the replay, made once per batch
+            std::function<void(rasterizer<VB, RT>&, const std::vector<draw_call<VB>>&)> draw_batch;
+        };
+        std::vector<pipeline_entry> pipelines;
+        size_t batch_count = 0;
+    };
+
+    template<typename VB>
+    inline void command_list<VB>::set_vertex_buffer(std::shared_ptr<resource<VB>> in_vertex_buffer)
+    {
+        vertex_buffer = in_vertex_buffer;
+    }
+
+    template<typename VB>
+    inline void command_list<VB>::set_index_buffer(std::shared_ptr<resource<unsigned int>> in_index_buffer)
+    {
+        index_buffer = in_index_buffer;
+    }
+
+    template<typename VB>
+    inline void command_list<VB>::draw(size_t pipeline_id, size_t num_vertexes, size_t vertex_offset, float depth)
+    {
+        // Bits of a non-negative float sort like the float itself
+        float key_depth = std::max(depth, 0.f);
+        uint32_t depth_bits;
+        std::memcpy(&depth_bits, &key_depth, sizeof(depth_bits));
+
+        commands.push_back(draw_command<VB>{
+            (static_cast<uint64_t>(pipeline_id) << 32) | depth_bits,
+            pipeline_id,
+            key_depth,
+            draw_call<VB>{ vertex_buffer, index_buffer, num_vertexes, vertex_offset, nullptr },
+            nullptr
+        });
+    }
+
+    template<typename VB>
+    inline void command_list<VB>::draw_meshlet(
+            size_t pipeline_id, const cg::world::meshlet& meshlet,
+            std::shared_ptr<resource<unsigned int>> vertex_list, float depth)
+    {
+        draw(pipeline_id, meshlet.index_count, meshlet.index_offset, depth);
+        commands.back().meshlet = &meshlet;
+        commands.back().call.vertex_list = std::move(vertex_list);
+    }
+
+    template<typename VB>
+    inline void command_list<VB>::reset()
+    {
+        commands.clear();
+    }
+
+    template<typename VB>
+    inline const std::vector<draw_command<VB>>& command_list<VB>::get_commands() const
+    {
+        return commands;
+    }
+
+    template<typename VB, typename RT>
+    template<typename Pipeline>
+    inline size_t command_queue<VB, RT>::add_pipeline(const Pipeline& pipeline, depth_func depth_comparison)
+    {
+        pipelines.push_back(pipeline_entry{
+            depth_comparison,
+            [pipeline](rasterizer<VB, RT>& target, const std::vector<draw_call<VB>>& calls) {
+                target.draw_batch(pipeline, calls);
+            }
+        });
+        return pipelines.size() - 1;
+    }
+
+    template<typename VB, typename RT>
+    inline void command_queue<VB, RT>::submit(
+            rasterizer<VB, RT>& target, const std::vector<command_list<VB>>& lists,
+            const float4x4& matrix)
+    {
+        auto frustum = cg::world::frustum::from_matrix(matrix);
+        float3 eye_position = rasterizer<VB, RT>::get_eye_position(matrix);
+
+        std::vector<const draw_command<VB>*> commands;
+        for (const auto& list : lists) {
+            for (const auto& command : list.get_commands()) {
+                commands.push_back(&command);
+            }
+        }
+        // Stable, so that equal keys keep the recording order
+        std::stable_sort(commands.begin(), commands.end(), [](const draw_command<VB>* a, const draw_command<VB>* b) {
+            return a->sort_key < b->sort_key;
+        });
+
+        batch_count = 0;
+        std::vector<draw_call<VB>> calls;
+        auto draw_calls = [&](size_t pipeline_id) {
+            if (calls.empty()) {
+                return;
+            }
+            const auto& entry = pipelines[pipeline_id];
+            target.set_depth_func(entry.depth_comparison);
+            entry.draw_batch(target, calls);
+            ++batch_count;
+            calls.clear();
+        };
+        for (size_t begin = 0; begin < commands.size();) {
+            size_t pipeline_id = commands[begin]->pipeline_id;
+            size_t end = begin;
+            float batch_depth = 0.f;
+            while (end < commands.size() && commands[end]->pipeline_id == pipeline_id) {
+                const auto* command = commands[end++];
+                // Draws are front to back, the nearer ones fill the Hi-Z first
+                if (command->meshlet && calls.size() >= min_batch_draws &&
+                    command->depth > batch_depth * batch_depth_ratio) {
+                    draw_calls(pipeline_id);
+                }
+                if (command->meshlet &&
+                    target.is_meshlet_culled(*command->meshlet, frustum, eye_position, matrix)) {
+                    continue;
+                }
+                if (calls.empty()) {
+                    batch_depth = command->depth;
+                }
+                calls.push_back(command->call);
+            }
+            draw_calls(pipeline_id);
+            begin = end;
+        }
+        target.set_depth_func(depth_func::less);
+    }
+
+    template<typename VB, typename RT>
+    inline size_t command_queue<VB, RT>::get_batch_count() const
+    {
+        return batch_count;
+    }
+}// namespace cg::renderer
@@ -1,18 +1,174 @@
 #pragma once
 
 #include "resource.h"
+#include "world/bounds.h"
 
+#include <array>
 #include <cfloat>
+#include <climits>
+#include <cstdint>
 #include <functional>
 #include <iostream>
 #include <linalg.h>
 #include <memory>
+#include <type_traits>
 
 
 using namespace linalg::aliases;
 
 namespace cg::renderer
 {
+    // One level of the hierarchical depth buffer: max depth per texel
+    struct hi_z_level
+    {
+        size_t width;
+        size_t height;
+        std::vector<float> max_depth;
+    };
+
+    enum class cull_mode
+    {
+        none,
+        back,
+        front
+    };
+
+    // Storage of depth inside the rasterizer. Compact formats are fixed point over [0, 1]
+    // and are decoded into the bound float depth buffer by flush(), see README
+    enum class depth_format
+    {
+        float32,
+        // Three bytes per pixel
+        unorm24,
+        unorm16
+    };
+
+    enum class depth_func
+    {
+        less,
+        // Color pass after a depth pre-pass: only the nearest fragment passes, depth is not written
+        equal
+    };
+
+    // Per-frame triangle counters, reset by clear_render_target
+    struct rasterizer_statistics
+    {
+        size_t meshlets_submitted = 0;
+        size_t meshlets_frustum_culled = 0;
+        size_t meshlets_cone_culled = 0;
+        size_t meshlets_occlusion_culled = 0;
+
+        size_t triangles_submitted = 0;
+        size_t triangles_frustum_culled = 0;
+        size_t triangles_face_culled = 0;
+        size_t triangles_degenerate_culled = 0;
+        size_t triangles_occlusion_culled = 0;
+        size_t triangles_rasterized = 0;
+
+        size_t fragments_shaded = 0;
+        size_t pixels_lit = 0;
+        // Pixels resolved from a single stored color
+        size_t pixels_compressed = 0;
+        // Tiles a triangle was entirely in front of, depth tests there read no depth
+        size_t depth_tiles_accepted = 0;
+    };
+
+    // Output of the geometry pass pixel shader in deferred shading
+    struct gbuffer_sample
+    {
+        float3 normal;
+        float3 albedo;
+        unsigned int material_id;
+    };
+
+    struct gbuffer
+    {
+        gbuffer(size_t width, size_t height) :
+            depth(std::make_shared<cg::resource<float>>(width, height)),
+            normal(std::make_shared<cg::resource<float3>>(width, height)),
+            albedo(std::make_shared<cg::resource<float3>>(width, height)),
+            material_id(std::make_shared<cg::resource<unsigned int>>(width, height))
+        {
+        }
+
+        // Marks pixels no geometry was written to
+        static constexpr unsigned int empty_material = UINT_MAX;
+
+        std::shared_ptr<cg::resource<float>> depth;
+        std::shared_ptr<cg::resource<float3>> normal;
+        std::shared_ptr<cg::resource<float3>> albedo;
+        std::shared_ptr<cg::resource<unsigned int>> material_id;
+    };
+
+    // Output of the visibility pass: shape and triangle index packed in 32 bits
+    struct visibility_sample
+    {
+        static constexpr unsigned int triangle_bits = 20;
+        static constexpr size_t max_shapes = size_t{ 1 } << (32 - triangle_bits);
+        static constexpr size_t max_triangles = size_t{ 1 } << triangle_bits;
+        // Marks pixels no geometry was written to
+        static constexpr unsigned int empty = UINT_MAX;
+
+        static visibility_sample pack(size_t shape_id, size_t triangle_id)
+        {
+            return visibility_sample{
+                static_cast<unsigned int>((shape_id << triangle_bits) | triangle_id)
+            };
+        }
+        size_t shape_id() const { return id >> triangle_bits; }
+        size_t triangle_id() const { return id & (max_triangles - 1); }
+
+        unsigned int id;
+    };
+
+    // Geometry of one draw in a batch, see rasterizer::draw_batch
+    template<typename VB>
+    struct draw_call
+    {
+        std::shared_ptr<cg::resource<VB>> vertex_buffer;
+        std::shared_ptr<cg::resource<unsigned int>> index_buffer;
+        size_t num_vertexes;
+        size_t vertex_offset;
+        // Meshlet draws: index_buffer indexes this list of vertex buffer ids, see
+        // rasterizer::draw_meshlets; nullptr otherwise
+        std::shared_ptr<cg::resource<unsigned int>> vertex_list;
+    };
+
+    // Clip-space vertex with its barycentric weights in the source triangle
+    struct clip_vertex
+    {
+        float4 position;
+        float3 weights;
+    };
+
+    // Shaders bound at compile time so they inline into the vertex and pixel loops.
+    // Layout lists the VB fields the pixel shader reads, see cg::vertex_layout
+    template<typename Layout, typename VS, typename PS>
+    struct pipeline_state
+    {
+        using layout = Layout;
+
+        VS vertex_shader;
+        PS pixel_shader;
+    };
+
+    // Pixel shader of depth-only passes: no shading, no color writes
+    struct depth_only_shader
+    {
+    };
+
+    template<typename Layout, typename VS, typename PS>
+    inline pipeline_state<Layout, VS, PS> make_pipeline_state(VS vertex_shader, PS pixel_shader)
+    {
+        return pipeline_state<Layout, VS, PS>{ vertex_shader, pixel_shader };
+    }
+
+    template<typename VS>
+    inline pipeline_state<attribute_layout<>, VS, depth_only_shader> make_depth_pipeline_state(VS vertex_shader)
+    {
+        return pipeline_state<attribute_layout<>, VS, depth_only_shader>{ vertex_shader, depth_only_shader{} };
+    }
+
     template<typename VB, typename RT>
     class rasterizer
     {
@@ -22,16 +178,98 @@ namespace cg::renderer
         void set_render_target(
                 std::shared_ptr<resource<RT>> in_render_target,
                 std::shared_ptr<resource<float>> in_depth_buffer = nullptr);
+        // Only flags every tile as cleared, the first write to a tile fills it
+        // with the clear values, see flush
         void clear_render_target(
                 const RT& in_clear_value, const float in_depth = FLT_MAX);
+        // Fills the tiles nothing was drawn to since the clear and decodes compact depth,
+        // in parallel. Needed before reading the buffers outside of the rasterizer;
+        // switching targets and the resolve passes flush by themselves
+        void flush();
+
+        // Deferred mode: pixel shaders returning gbuffer_sample write here instead of the render target
+        void set_gbuffer(std::shared_ptr<gbuffer> in_gbuffer);
+        // Visibility mode: pixel shaders returning visibility_sample write here
+        void set_visibility_buffer(std::shared_ptr<resource<unsigned int>> in_visibility_buffer);
 
         void set_vertex_buffer(std::shared_ptr<resource<VB>> in_vertex_buffer);
         void set_index_buffer(std::shared_ptr<resource<unsigned int>> in_index_buffer);
+        // Per-instance transforms, fetched by the vertex shader of draw_instanced
+        void set_instance_buffer(std::shared_ptr<resource<float4x4>> in_instance_buffer);
 
         void set_viewport(size_t in_width, size_t in_height);
+        void set_cull_mode(cull_mode in_cull_mode);
+        void set_depth_func(depth_func in_depth_func);
+        void set_depth_format(depth_format in_depth_format);
+        // Largest LOD error allowed on screen, in pixels, 0 keeps full detail
+        void set_lod_threshold(float in_lod_threshold);
+        // 1, 4 or 8; with more than one sample, color pixel shaders write to the
+        // multi-sample storage and resolve_samples() fills the render target
+        void set_sample_count(size_t in_sample_count);
+
+        const rasterizer_statistics& get_statistics() const;
 
+        template<typename Pipeline>
+        void draw(const Pipeline& pipeline, size_t num_vertexes, size_t vertex_offest);
+
+        // Depth pre-pass: fills depth and Hi-Z only, see depth_func::equal for the color pass
+        template<typename VS>
+        void draw_depth(const VS& vertex_shader, size_t num_vertexes, size_t vertex_offest);
+
+        // Goes through vertex_shader and pixel_shader, prefer the pipeline_state overload
+        template<typename Layout = typename vertex_layout<VB>::all>
         void draw(size_t num_vertexes, size_t vertex_offest);
 
+        // Draws the index range once for each instance in [instance_offset, instance_offset + num_instances).
+        // The vertex shader takes the instance transform as a third argument and runs once per
+        // vertex and instance; the triangles of all instances are binned to screen tiles that
+        // are rasterized in parallel, so the pixel shader must not mutate shared state
+        template<typename Pipeline>
+        void draw_instanced(
+                const Pipeline& pipeline, size_t num_vertexes, size_t vertex_offest,
+                size_t num_instances, size_t instance_offset = 0);
+
+        // Draws with their own vertex and index buffers, sharing one pipeline, go through
+        // the tile-parallel backend of draw_instanced as a single submission, in order
+        template<typename Pipeline>
+        void draw_batch(const Pipeline& pipeline, const std::vector<draw_call<VB>>& calls);
+
+        // Cluster culling stage: meshlets are tested against the frustum, their normal cone
+        // and Hi-Z, only the survivors reach vertex processing. The current index buffer
+        // indexes vertex_list and each meshlet shades just its own run of it, see cg::world::lod
+        template<typename Pipeline>
+        void draw_meshlets(
+                const Pipeline& pipeline, const std::vector<cg::world::meshlet>& meshlets,
+                cg::resource<unsigned int>& vertex_list, const float4x4& matrix);
+
+        // Culling of draw_meshlets for one meshlet, counted in the statistics. Eye is
+        // the model space camera position, see get_eye_position
+        bool is_meshlet_culled(
+                const cg::world::meshlet& meshlet, const cg::world::frustum& frustum,
+                const float3& eye, const float4x4& matrix);
+        static float3 get_eye_position(const float4x4& matrix);
+        bool is_occluded(float3 aabb_min, float3 aabb_max, const float4x4& matrix);
+
+        // Coarsest level of the chain whose error projects under the LOD threshold
+        // at the nearest point of the bounding sphere
+        template<typename LodChain>
+        size_t select_lod(const LodChain& lods, const cg::world::bounding_sphere& sphere, const float4x4& matrix) const;
+
+        // Box filter of the samples of every pixel into the render target
+        void resolve_samples();
+
+        // Deferred lighting pass: shades every covered G-buffer pixel exactly once
+        template<typename LS>
+        void shade_gbuffer(const LS& lighting_shader);
+
+        // Resolve pass of visibility buffer rendering: refetches the triangle of every
+        // covered pixel, reconstructs its barycentrics and runs the pipeline on it
+        template<typename Pipeline>
+        void resolve_visibility(
+                const Pipeline& pipeline,
+                const std::vector<std::shared_ptr<cg::resource<VB>>>& vertex_buffers,
+                const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& index_buffers);
+
         std::function<std::pair<float4, VB>(float4 vertex, VB vertex_data)> vertex_shader;
         std::function<cg::color(const VB& vertex_data, const float z)> pixel_shader;
 
@@ -40,12 +278,166 @@ namespace cg::renderer
         std::shared_ptr<cg::resource<unsigned int>> index_buffer;
         std::shared_ptr<cg::resource<RT>> render_target;
         std::shared_ptr<cg::resource<float>> depth_buffer;
+        std::shared_ptr<gbuffer> geometry_buffer;
+        std::shared_ptr<cg::resource<unsigned int>> visibility_buffer;
+        std::shared_ptr<cg::resource<float4x4>> instance_buffer;
+
+        // Post-transform cache: vertex shader output for the index range of the draw,
+        // from its smallest index on; instanced draws keep one run per instance
+        std::vector<std::pair<float4, VB>> transformed_vertices;
 
         size_t width  = 1920;
         size_t height = 1080;
 
+        // Counter-clockwise triangles are front-facing. Back faces are culled by default,
+        // the baseline edge test only ever drew the front winding
+        cull_mode culling = cull_mode::back;
+        depth_func depth_comparison = depth_func::less;
+        float lod_threshold = 1.f;
+        rasterizer_statistics statistics;
+
+        // Multi-sample storage is compressed per pixel: up to sample_count distinct
+        // colors, and a 4 bit index into them per sample. A pixel covered by one
+        // triangle keeps a single color and resolves without reading the samples.
+        // The depth buffer holds the farthest sample depth of a pixel for Hi-Z
+        static constexpr size_t max_samples = 8;
+        size_t sample_count = 1;
+        std::array<float2, max_samples> sample_offsets;
+        std::vector<float> sample_depths;
+        std::vector<cg::color> fragment_colors;
+        std::vector<uint32_t> fragment_indexes;
+        std::vector<uint8_t> fragment_counts;
+
+        // Level 0 of hi_z keeps one texel per tile_size x tile_size pixels
+        static constexpr size_t tile_size = 8;
+        std::vector<hi_z_level> hi_z;
+
+        // Smallest depth per tile, next to the largest in hi_z[0]
+        std::vector<float> tile_min_depth;
+
+        depth_format depth_storage = depth_format::float32;
+        std::vector<uint16_t> depth16;
+        std::vector<uint8_t> depth24;
+        // Compact depth changed since the float depth buffer was last decoded
+        bool compact_depth_stale = false;
+
+        // Fast clear: tiles still holding whatever was there before the last clear.
+        // Bytes rather than vector<bool>, bins flag their own tiles concurrently
+        std::vector<uint8_t> cleared_tiles;
+        RT clear_value{};
+        float clear_depth = FLT_MAX;
+
+        // Triangles reaching past guard_band * w are clipped, the rest only scissored
+        static constexpr float guard_band = 4.f;
+        static constexpr float equal_depth_tolerance = 1e-6f;
+        // A triangle clipped by the near plane and four guard-band planes has up to 8 corners
+        static constexpr size_t max_clip_vertices = 9;
+
+        // Screen rectangle of the tile-parallel backend, rasterized by one thread.
+        // Bins are aligned to Hi-Z tiles, so threads never share a depth tile
+        static constexpr size_t bin_size = 8 * tile_size;
+        struct raster_bin
+        {
+            size_t begin_x;
+            size_t begin_y;
+            size_t end_x;
+            size_t end_y;
+            // Indexes into binned_triangles in submission order
+            std::vector<size_t> triangles;
+            // Outcome of every triangle in this bin, in the order of triangles
+            std::vector<uint8_t> outcomes;
+            // Merged into statistics once every bin is done
+            rasterizer_statistics statistics;
+        };
+        // What rasterize_triangle did with a triangle, as bits. Statistics count source
+        // triangles: one clipped into a fan or binned in several bins is counted once,
+        // by the best outcome any of its parts had, see count_outcome
+        enum triangle_outcome : uint8_t
+        {
+            outcome_none = 0,
+            outcome_degenerate = 1,
+            outcome_occluded = 2,
+            outcome_rasterized = 4
+        };
+        struct binned_triangle
+        {
+            std::array<clip_vertex, 3> corners;
+            std::array<const VB*, 3> vertex_data;
+            size_t primitive_id;
+            // Index of the source triangle since begin_bins, a clipped one has several parts
+            size_t source_id;
+        };
+        std::vector<raster_bin> bins;
+        std::vector<binned_triangle> binned_triangles;
+        size_t binned_sources = 0;
+        void count_outcome(uint8_t outcome);
+
         float edge_function(float2 a, float2 b, float2 c);
         bool depth_test(float z, size_t x, size_t y);
+        float read_depth(size_t x, size_t y);
+        void write_depth(size_t x, size_t y, float z);
+        // Depth as it reads back after a write in the current format
+        float quantize_depth(float z) const;
+        uint32_t encode_depth(float z) const;
+        float decode_depth(uint32_t code) const;
+        void allocate_depth();
+        // Float depth buffer into the compact storage and back
+        void load_depth();
+        void store_depth();
+        bool depth_passes(float stored, float z) const;
+        bool depth_rejects(float min_z, float max_depth) const;
+        bool is_cone_culled(const cg::world::meshlet& meshlet, const float3& eye) const;
+
+        void write_pixel(size_t x, size_t y, const cg::color& color);
+        void write_pixel(size_t x, size_t y, const gbuffer_sample& sample);
+        void write_pixel(size_t x, size_t y, const visibility_sample& sample);
+        void write_samples(size_t x, size_t y, unsigned int coverage, const cg::color& color);
+        void allocate_samples();
+        // Writes the clear values to a tile flagged as cleared
+        void materialize_tile(size_t tile_x, size_t tile_y);
+
+        // Draw through an optional list the indexes point into, see draw_meshlets
+        template<typename Pipeline>
+        void draw(
+                const Pipeline& pipeline, size_t num_vertexes, size_t vertex_offset,
+                cg::resource<unsigned int>* vertex_list);
+        // Shades the index range of the draw into the post-transform cache, fetching
+        // through vertex_list when given; returns the smallest index
+        template<typename VS>
+        unsigned int process_vertices(
+                const VS& shader, size_t num_vertexes, size_t vertex_offset,
+                cg::resource<unsigned int>* vertex_list);
+        template<typename VS>
+        void process_instances(
+                const VS& shader, unsigned int min_index, unsigned int max_index,
+                size_t num_instances, size_t instance_offset);
+        // Tile-parallel backend: begin_bins, then bin_triangles per draw, then rasterize_bins
+        void begin_bins();
+        void bin_triangles(
+                cg::resource<unsigned int>& indexes, const std::pair<float4, VB>* cache,
+                unsigned int min_index, size_t num_vertexes, size_t vertex_offset);
+        template<typename Pipeline>
+        void rasterize_bins(const Pipeline& pipeline);
+        // Culls and clips the triangle in the first three corners of polygon,
+        // returns the number of corners left, under 3 when nothing is left to draw
+        size_t setup_triangle(std::array<clip_vertex, max_clip_vertices>& polygon);
+        size_t clip_polygon(
+                std::array<clip_vertex, max_clip_vertices>& polygon,
+                size_t num_vertices, const float4& plane);
+        // Triangle counters are left to the caller, which knows the source triangle
+        template<typename Pipeline>
+        triangle_outcome rasterize_triangle(
+                const Pipeline& pipeline,
+                const clip_vertex& a, const clip_vertex& b, const clip_vertex& c,
+                const VB& vertex_a, const VB& vertex_b, const VB& vertex_c,
+                size_t primitive_id, raster_bin* bin = nullptr);
+
+        void build_hi_z();
+        // Without propagate only level 0 is updated, see propagate_hi_z
+        void update_hi_z(size_t tile_x, size_t tile_y, bool propagate = true);
+        // Rebuilds every level above 0 from level 0
+        void propagate_hi_z();
+        bool hi_z_test(float min_z, size_t begin_x, size_t begin_y, size_t end_x, size_t end_y);
     };
 
     template<typename VB, typename RT>
@@ -53,12 +445,15 @@ namespace cg::renderer
             std::shared_ptr<resource<RT>> in_render_target,
             std::shared_ptr<resource<float>> in_depth_buffer)
     {
+        flush();
         if (in_render_target) {
             render_target = in_render_target;
         }
 
         if (in_depth_buffer) {
             depth_buffer = in_depth_buffer;
+            build_hi_z();
+            load_depth();
         }
     }
 
@@ -66,17 +461,108 @@ namespace cg::renderer
     inline void rasterizer<VB, RT>::clear_render_target(
             const RT& in_clear_value, const float in_depth)
     {
-        if (render_target) {
-            for (auto i = 0; i < render_target->get_number_of_elements(); ++i) {
-                render_target->item(i) = in_clear_value;
-            }
+        statistics = rasterizer_statistics{};
+
+        clear_value = in_clear_value;
+        clear_depth = in_depth;
+        cleared_tiles.assign(((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size), 1);
+
+        for (auto& level : hi_z) {
+            std::fill(level.max_depth.begin(), level.max_depth.end(), in_depth);
+        }
+        std::fill(tile_min_depth.begin(), tile_min_depth.end(), in_depth);
+        compact_depth_stale = true;
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::flush()
+    {
+        size_t tiles_x = (width + tile_size - 1) / tile_size;
+#pragma omp parallel for schedule(dynamic)
+        for (int tile = 0; tile < static_cast<int>(cleared_tiles.size()); ++tile) {
+            materialize_tile(tile % tiles_x, tile / tiles_x);
+        }
+        store_depth();
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::materialize_tile(size_t tile_x, size_t tile_y)
+    {
+        if (cleared_tiles.empty()) {
+            return;
+        }
+        uint8_t& cleared = cleared_tiles[tile_y * ((width + tile_size - 1) / tile_size) + tile_x];
+        if (!cleared) {
+            return;
         }
+        cleared = 0;
 
-        if (depth_buffer) {
-            for (auto i = 0; i < depth_buffer->get_number_of_elements(); ++i) {
-                depth_buffer->item(i) = in_depth;
+        // Row-wise fills, one bounds check per row
+        size_t begin_x = tile_x * tile_size;
+        size_t end_x = std::min(width, begin_x + tile_size);
+        size_t row_size = end_x - begin_x;
+        for (size_t y = tile_y * tile_size; y < std::min(height, (tile_y + 1) * tile_size); ++y) {
+            if (render_target) {
+                std::fill_n(&render_target->item(begin_x, y), row_size, clear_value);
+            }
+            if (depth_buffer) {
+                switch (depth_storage) {
+                    case depth_format::float32:
+                        std::fill_n(&depth_buffer->item(begin_x, y), row_size, clear_depth);
+                        break;
+                    case depth_format::unorm24:
+                        for (size_t x = begin_x; x < end_x; ++x) {
+                            write_depth(x, y, clear_depth);
+                        }
+                        break;
+                    case depth_format::unorm16:
+                        std::fill_n(&depth16[y * width + begin_x], row_size, static_cast<uint16_t>(encode_depth(clear_depth)));
+                        break;
+                }
+            }
+            if (geometry_buffer) {
+                std::fill_n(&geometry_buffer->material_id->item(begin_x, y), row_size, gbuffer::empty_material);
             }
+            if (visibility_buffer) {
+                std::fill_n(&visibility_buffer->item(begin_x, y), row_size, visibility_sample::empty);
+            }
+            if (sample_count > 1) {
+                size_t pixel = y * width + begin_x;
+                cg::color clear_color = clear_value.to_color();
+                std::fill_n(&sample_depths[pixel * sample_count], row_size * sample_count, clear_depth);
+                for (size_t i = pixel; i < pixel + row_size; ++i) {
+                    fragment_colors[i * sample_count] = clear_color;
+                }
+                std::fill_n(&fragment_indexes[pixel], row_size, 0);
+                std::fill_n(&fragment_counts[pixel], row_size, 1);
+            }
+        }
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::set_gbuffer(std::shared_ptr<gbuffer> in_gbuffer)
+    {
+        if (in_gbuffer && sample_count > 1) {
+            THROW_ERROR("Multi-sampling supports only color render targets");
         }
+        flush();
+        geometry_buffer = in_gbuffer;
+        if (geometry_buffer) {
+            depth_buffer = geometry_buffer->depth;
+            build_hi_z();
+            load_depth();
+        }
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::set_visibility_buffer(
+            std::shared_ptr<resource<unsigned int>> in_visibility_buffer)
+    {
+        if (in_visibility_buffer && sample_count > 1) {
+            THROW_ERROR("Multi-sampling supports only color render targets");
+        }
+        flush();
+        visibility_buffer = in_visibility_buffer;
     }
 
     template<typename VB, typename RT>
@@ -93,115 +579,1345 @@ namespace cg::renderer
         index_buffer = in_index_buffer;
     }
 
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::set_instance_buffer(
+            std::shared_ptr<resource<float4x4>> in_instance_buffer)
+    {
+        instance_buffer = in_instance_buffer;
+    }
+
     template<typename VB, typename RT>
     inline void rasterizer<VB, RT>::set_viewport(size_t in_width, size_t in_height)
     {
+        flush();
+        cleared_tiles.clear();
         width  = in_width;
         height = in_height;
+        allocate_samples();
+        allocate_depth();
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::set_cull_mode(cull_mode in_cull_mode)
+    {
+        culling = in_cull_mode;
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::set_depth_func(depth_func in_depth_func)
+    {
+        depth_comparison = in_depth_func;
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::set_depth_format(depth_format in_depth_format)
+    {
+        flush();
+        depth_storage = in_depth_format;
+        allocate_depth();
+        load_depth();
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::set_lod_threshold(float in_lod_threshold)
+    {
+        lod_threshold = in_lod_threshold;
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::set_sample_count(size_t in_sample_count)
+    {
+        // Standard D3D sample positions in 1/16 pixel units around the pixel center
+        static const float2 pattern_4x[] = {
+            { -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 }
+        };
+        static const float2 pattern_8x[] = {
+            { 1, -3 }, { -1, 3 }, { 5, 1 }, { -3, -5 },
+            { -5, 5 }, { -7, -1 }, { 3, 7 }, { 7, -7 }
+        };
+
+        if (in_sample_count != 1 && in_sample_count != 4 && in_sample_count != 8) {
+            THROW_ERROR("Unsupported sample count: " + std::to_string(in_sample_count));
+        }
+        if (in_sample_count > 1 && (geometry_buffer || visibility_buffer)) {
+            THROW_ERROR("Multi-sampling supports only color render targets");
+        }
+
+        sample_count = in_sample_count;
+        const float2* pattern = sample_count == 8 ? pattern_8x : pattern_4x;
+        for (size_t i = 0; i < sample_count && sample_count > 1; ++i) {
+            sample_offsets[i] = pattern[i] / 16.f;
+        }
+        allocate_samples();
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::allocate_samples()
+    {
+        if (sample_count == 1) {
+            sample_depths.clear();
+            fragment_colors.clear();
+            fragment_indexes.clear();
+            fragment_counts.clear();
+            return;
+        }
+        sample_depths.assign(width * height * sample_count, FLT_MAX);
+        fragment_colors.resize(width * height * sample_count);
+        fragment_indexes.assign(width * height, 0);
+        fragment_counts.assign(width * height, 1);
     }
 
     template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::resolve_samples()
+    {
+        if (sample_count == 1) {
+            return;
+        }
+        flush();
+
+        size_t pixels_compressed = 0;
+#pragma omp parallel for reduction(+ : pixels_compressed)
+        for (int pixel = 0; pixel < static_cast<int>(width * height); ++pixel) {
+            const cg::color* colors = &fragment_colors[pixel * sample_count];
+            if (fragment_counts[pixel] == 1) {
+                render_target->item(pixel) = RT::from_color(colors[0]);
+                ++pixels_compressed;
+                continue;
+            }
+            float3 sum{ 0, 0, 0 };
+            for (size_t sample = 0; sample < sample_count; ++sample) {
+                sum += colors[(fragment_indexes[pixel] >> (4 * sample)) & 0xF].to_float3();
+            }
+            render_target->item(pixel) = RT::from_color(cg::color::from_float3(sum / static_cast<float>(sample_count)));
+        }
+        statistics.pixels_compressed = pixels_compressed;
+    }
+
+    template<typename VB, typename RT>
+    inline const rasterizer_statistics& rasterizer<VB, RT>::get_statistics() const
+    {
+        return statistics;
+    }
+
+    template<typename VB, typename RT>
+    template<typename Layout>
     inline void rasterizer<VB, RT>::draw(size_t num_vertexes, size_t vertex_offset)
     {
-        size_t vertex_id = vertex_offset;
+        auto pipeline = make_pipeline_state<Layout>(
+            [this](float4 vertex, const VB& vertex_data) {
+                return vertex_shader(vertex, vertex_data);
+            },
+            [this](const VB& vertex_data, const float z) {
+                return pixel_shader(vertex_data, z);
+            }
+        );
+        draw(pipeline, num_vertexes, vertex_offset);
+    }
+
+    template<typename VB, typename RT>
+    template<typename VS>
+    inline void rasterizer<VB, RT>::draw_depth(
+            const VS& vertex_shader, size_t num_vertexes, size_t vertex_offset)
+    {
+        draw(make_depth_pipeline_state(vertex_shader), num_vertexes, vertex_offset);
+    }
+
+    template<typename VB, typename RT>
+    template<typename Pipeline>
+    inline void rasterizer<VB, RT>::draw_meshlets(
+            const Pipeline& pipeline, const std::vector<cg::world::meshlet>& meshlets,
+            cg::resource<unsigned int>& vertex_list, const float4x4& matrix)
+    {
+        auto frustum = cg::world::frustum::from_matrix(matrix);
+        float3 eye_position = get_eye_position(matrix);
+
+        for (const auto& meshlet : meshlets) {
+            if (!is_meshlet_culled(meshlet, frustum, eye_position, matrix)) {
+                draw(pipeline, meshlet.index_count, meshlet.index_offset, &vertex_list);
+            }
+        }
+    }
+
+    template<typename VB, typename RT>
+    inline bool rasterizer<VB, RT>::is_meshlet_culled(
+            const cg::world::meshlet& meshlet, const cg::world::frustum& frustum,
+            const float3& eye, const float4x4& matrix)
+    {
+        ++statistics.meshlets_submitted;
+        if (!frustum.intersects(meshlet.sphere)) {
+            ++statistics.meshlets_frustum_culled;
+            return true;
+        }
+        if (is_cone_culled(meshlet, eye)) {
+            ++statistics.meshlets_cone_culled;
+            return true;
+        }
+        float3 extent{ meshlet.sphere.radius, meshlet.sphere.radius, meshlet.sphere.radius };
+        if (is_occluded(meshlet.sphere.center - extent, meshlet.sphere.center + extent, matrix)) {
+            ++statistics.meshlets_occlusion_culled;
+            return true;
+        }
+        return false;
+    }
+
+    // The eye is the model space point projected to x = y = w = 0
+    template<typename VB, typename RT>
+    inline float3 rasterizer<VB, RT>::get_eye_position(const float4x4& matrix)
+    {
+        float4 eye = mul(inverse(matrix), float4{ 0, 0, 1, 0 });
+        return float3{ eye.x, eye.y, eye.z } / eye.w;
+    }
+
+    template<typename VB, typename RT>
+    template<typename Pipeline>
+    inline void rasterizer<VB, RT>::draw(
+            const Pipeline& pipeline, size_t num_vertexes, size_t vertex_offset)
+    {
+        draw(pipeline, num_vertexes, vertex_offset, nullptr);
+    }
+
+    template<typename VB, typename RT>
+    template<typename Pipeline>
+    inline void rasterizer<VB, RT>::draw(
+            const Pipeline& pipeline, size_t num_vertexes, size_t vertex_offset,
+            cg::resource<unsigned int>* vertex_list)
+    {
+        unsigned int min_index = process_vertices(pipeline.vertex_shader, num_vertexes, vertex_offset, vertex_list);
+
         for (size_t vertex_id = vertex_offset; vertex_id < vertex_offset + num_vertexes; vertex_id += 3) {
-            std::vector<VB> vertices(3);
-            vertices[0] = vertex_buffer->item(index_buffer->item(vertex_id + 0));
-            vertices[1] = vertex_buffer->item(index_buffer->item(vertex_id + 1));
-            vertices[2] = vertex_buffer->item(index_buffer->item(vertex_id + 2));
-            for (auto& vertex : vertices) {
-                float4 coords{ vertex.x, vertex.y, vertex.z, 1.0f };
-                auto processed_vertex = vertex_shader(coords, vertex);
-
-                vertex.x = processed_vertex.first.x / processed_vertex.first.w;
-                vertex.y = processed_vertex.first.y / processed_vertex.first.w;
-                vertex.z = processed_vertex.first.z / processed_vertex.first.w;
-
-                vertex.x = (vertex.x  + 1) * width  / 2.f;
-                vertex.y = (-vertex.y + 1) * height / 2.f;
-            }
-
-            float2 bounding_box_begin{
-                std::clamp(
-                    std::min(std::min(vertices[0].x, vertices[1].x), vertices[2].x),
-                    0.f, static_cast<float>(width - 1)
-                ),
-                std::clamp(
-                    std::min(std::min(vertices[0].y, vertices[1].y), vertices[2].y),
-                    0.f, static_cast<float>(height - 1)
-                ),
-            };
-            float2 bounding_box_end{
-                std::clamp(
-                    std::max(std::max(vertices[0].x, vertices[1].x), vertices[2].x),
-                    0.f, static_cast<float>(width - 1)
-                ),
-                std::clamp(
-                    std::max(std::max(vertices[0].y, vertices[1].y), vertices[2].y),
-                    0.f, static_cast<float>(height - 1)
-                ),
-            };
+            std::array<clip_vertex, max_clip_vertices> polygon;
+            std::array<const VB*, 3> vertex_data;
+            for (size_t i = 0; i < 3; ++i) {
+                const auto& processed_vertex = transformed_vertices[index_buffer->item(vertex_id + i) - min_index];
+                vertex_data[i] = &processed_vertex.second;
+                polygon[i].position = processed_vertex.first;
+                polygon[i].weights = float3{ i == 0 ? 1.f : 0.f, i == 1 ? 1.f : 0.f, i == 2 ? 1.f : 0.f };
+            }
 
-            float edge = edge_function(
-                float2{ vertices[0].x, vertices[0].y },
-                float2{ vertices[1].x, vertices[1].y },
-                float2{ vertices[2].x, vertices[2].y }
-            );
-
-            for (int32_t y = static_cast<int32_t>(bounding_box_begin.y); y < bounding_box_end.y; ++y) {
-                for (int32_t x = static_cast<int32_t>(bounding_box_begin.x); x < bounding_box_end.x; ++x) {
-                    float2 point{ static_cast<float>(x), static_cast<float>(y) };
-                    float edge0 = edge_function(
-                        float2{ vertices[0].x, vertices[0].y },
-                        float2{ vertices[1].x, vertices[1].y },
-                        point
-                    );
-                    float edge1 = edge_function(
-                        float2{ vertices[1].x, vertices[1].y },
-                        float2{ vertices[2].x, vertices[2].y },
-                        point
-                    );
-                    float edge2 = edge_function(
-                        float2{ vertices[2].x, vertices[2].y },
-                        float2{ vertices[0].x, vertices[0].y },
-                        point
-                    );
-
-                    float u = edge1 / edge;
-                    float v = edge2 / edge;
-                    float w = edge0 / edge;
-                    float depth =
-                        u * vertices[0].z +
-                        v * vertices[1].z +
-                        w * vertices[2].z;
-
-                    bool inside_triangle = (edge0 >= 0) && (edge1 >= 0) && (edge2 >= 0);
-                    if (inside_triangle && depth_test(depth, x, y)) {
-                        auto pixel_result = pixel_shader(vertices[0], depth);
-                        render_target->item(x, y) = RT::from_color(pixel_result);
-                        if (depth_buffer) {
-                            depth_buffer->item(x, y) = depth;
-                        }
-                    }
-                }
+            size_t num_vertices = setup_triangle(polygon);
+            uint8_t outcome = outcome_none;
+            for (size_t i = 1; i + 1 < num_vertices; ++i) {
+                outcome |= rasterize_triangle(
+                        pipeline, polygon[0], polygon[i], polygon[i + 1],
+                        *vertex_data[0], *vertex_data[1], *vertex_data[2],
+                        vertex_id / 3);
+            }
+            if (num_vertices >= 3) {
+                count_outcome(outcome);
             }
         }
     }
 
     template<typename VB, typename RT>
-    inline float
-    rasterizer<VB, RT>::edge_function(float2 a, float2 b, float2 c)
+    inline void rasterizer<VB, RT>::count_outcome(uint8_t outcome)
     {
-        return (c.x - a.x) * (b.y - a.y) - (c.y - a.y) * (b.x - a.x);
+        if (outcome & outcome_rasterized) {
+            ++statistics.triangles_rasterized;
+        }
+        else if (outcome & outcome_occluded) {
+            ++statistics.triangles_occlusion_culled;
+        }
+        else if (outcome & outcome_degenerate) {
+            ++statistics.triangles_degenerate_culled;
+        }
     }
 
     template<typename VB, typename RT>
-    inline bool rasterizer<VB, RT>::depth_test(float z, size_t x, size_t y)
+    template<typename Pipeline>
+    inline void rasterizer<VB, RT>::draw_instanced(
+            const Pipeline& pipeline, size_t num_vertexes, size_t vertex_offset,
+            size_t num_instances, size_t instance_offset)
     {
-        if (!depth_buffer) {
-            return true;
+        if (!instance_buffer || instance_offset + num_instances > instance_buffer->get_number_of_elements()) {
+            THROW_ERROR("Instance range is out of the instance buffer");
+        }
+
+        unsigned int min_index = UINT_MAX;
+        unsigned int max_index = 0;
+        for (size_t vertex_id = vertex_offset; vertex_id < vertex_offset + num_vertexes; ++vertex_id) {
+            unsigned int index = index_buffer->item(vertex_id);
+            min_index = std::min(min_index, index);
+            max_index = std::max(max_index, index);
+        }
+        if (min_index > max_index || num_instances == 0) {
+            return;
+        }
+        process_instances(pipeline.vertex_shader, min_index, max_index, num_instances, instance_offset);
+        size_t cache_stride = max_index - min_index + 1;
+
+        begin_bins();
+        for (size_t instance = 0; instance < num_instances; ++instance) {
+            bin_triangles(
+                    *index_buffer, &transformed_vertices[instance * cache_stride],
+                    min_index, num_vertexes, vertex_offset);
+        }
+        rasterize_bins(pipeline);
+    }
+
+    template<typename VB, typename RT>
+    template<typename Pipeline>
+    inline void rasterizer<VB, RT>::draw_batch(const Pipeline& pipeline, const std::vector<draw_call<VB>>& calls)
+    {
+        // Every draw gets its own run of the post-transform cache
+        std::vector<unsigned int> min_indexes(calls.size(), UINT_MAX);
+        std::vector<size_t> cache_offsets(calls.size() + 1, 0);
+        for (size_t call_id = 0; call_id < calls.size(); ++call_id) {
+            const auto& call = calls[call_id];
+            unsigned int max_index = 0;
+            for (size_t vertex_id = call.vertex_offset; vertex_id < call.vertex_offset + call.num_vertexes; ++vertex_id) {
+                unsigned int index = call.index_buffer->item(vertex_id);
+                min_indexes[call_id] = std::min(min_indexes[call_id], index);
+                max_index = std::max(max_index, index);
+            }
+            size_t cache_size = min_indexes[call_id] > max_index ? 0 : max_index - min_indexes[call_id] + 1;
+            cache_offsets[call_id + 1] = cache_offsets[call_id] + cache_size;
+        }
+        if (transformed_vertices.size() < cache_offsets.back()) {
+            transformed_vertices.resize(cache_offsets.back());
+        }
+
+#pragma omp parallel for schedule(dynamic)
+        for (int call_id = 0; call_id < static_cast<int>(calls.size()); ++call_id) {
+            const VB* vertices = calls[call_id].vertex_buffer->get_data();
+            auto* vertex_list = calls[call_id].vertex_list.get();
+            for (size_t item = cache_offsets[call_id]; item < cache_offsets[call_id + 1]; ++item) {
+                unsigned int index = static_cast<unsigned int>(min_indexes[call_id] + item - cache_offsets[call_id]);
+                const VB& vertex = vertices[vertex_list ? vertex_list->item(index) : index];
+                transformed_vertices[item] = pipeline.vertex_shader(float4{ vertex.x, vertex.y, vertex.z, 1.0f }, vertex);
+            }
+        }
+
+        begin_bins();
+        for (size_t call_id = 0; call_id < calls.size(); ++call_id) {
+            if (cache_offsets[call_id] == cache_offsets[call_id + 1]) {
+                continue;
+            }
+            bin_triangles(
+                    *calls[call_id].index_buffer, &transformed_vertices[cache_offsets[call_id]],
+                    min_indexes[call_id], calls[call_id].num_vertexes, calls[call_id].vertex_offset);
+        }
+        rasterize_bins(pipeline);
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::begin_bins()
+    {
+        size_t bins_x = (width + bin_size - 1) / bin_size;
+        size_t bins_y = (height + bin_size - 1) / bin_size;
+        bins.resize(bins_x * bins_y);
+        for (size_t bin_y = 0; bin_y < bins_y; ++bin_y) {
+            for (size_t bin_x = 0; bin_x < bins_x; ++bin_x) {
+                auto& bin = bins[bin_y * bins_x + bin_x];
+                bin.begin_x = bin_x * bin_size;
+                bin.begin_y = bin_y * bin_size;
+                bin.end_x = std::min(width, (bin_x + 1) * bin_size);
+                bin.end_y = std::min(height, (bin_y + 1) * bin_size);
+                bin.triangles.clear();
+                bin.outcomes.clear();
+                bin.statistics = rasterizer_statistics{};
+            }
+        }
+        binned_triangles.clear();
+        binned_sources = 0;
+    }
+
+    // Front end: setup of every triangle of a draw, in submission order
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::bin_triangles(
+            cg::resource<unsigned int>& indexes, const std::pair<float4, VB>* cache,
+            unsigned int min_index, size_t num_vertexes, size_t vertex_offset)
+    {
+        size_t bins_x = (width + bin_size - 1) / bin_size;
+        size_t bins_y = (height + bin_size - 1) / bin_size;
+
+        for (size_t vertex_id = vertex_offset; vertex_id < vertex_offset + num_vertexes; vertex_id += 3) {
+            std::array<clip_vertex, max_clip_vertices> polygon;
+            std::array<const VB*, 3> vertex_data;
+            for (size_t i = 0; i < 3; ++i) {
+                const auto& processed_vertex = cache[indexes.item(vertex_id + i) - min_index];
+                vertex_data[i] = &processed_vertex.second;
+                polygon[i].position = processed_vertex.first;
+                polygon[i].weights = float3{ i == 0 ? 1.f : 0.f, i == 1 ? 1.f : 0.f, i == 2 ? 1.f : 0.f };
+            }
+
+            size_t num_vertices = setup_triangle(polygon);
+            if (num_vertices < 3) {
+                continue;
+            }
+            size_t source_id = binned_sources;
+            for (size_t i = 1; i + 1 < num_vertices; ++i) {
+                // Screen bounds with a pixel of margin pick the bins, rasterize_triangle
+                // computes the exact pixel range
+                float2 screen_min{ FLT_MAX, FLT_MAX };
+                float2 screen_max{ -FLT_MAX, -FLT_MAX };
+                for (const clip_vertex* corner : { &polygon[0], &polygon[i], &polygon[i + 1] }) {
+                    float2 screen{
+                        (corner->position.x / corner->position.w + 1) * width / 2.f,
+                        (-corner->position.y / corner->position.w + 1) * height / 2.f
+                    };
+                    screen_min = min(screen_min, screen);
+                    screen_max = max(screen_max, screen);
+                }
+                if (screen_max.x < -1.f || screen_max.y < -1.f ||
+                    screen_min.x > static_cast<float>(width) || screen_min.y > static_cast<float>(height)) {
+                    continue;
+                }
+                size_t first_x = static_cast<size_t>(std::max(screen_min.x - 1.f, 0.f)) / bin_size;
+                size_t first_y = static_cast<size_t>(std::max(screen_min.y - 1.f, 0.f)) / bin_size;
+                size_t last_x = std::min(static_cast<size_t>(screen_max.x + 1.f) / bin_size, bins_x - 1);
+                size_t last_y = std::min(static_cast<size_t>(screen_max.y + 1.f) / bin_size, bins_y - 1);
+
+                binned_triangles.push_back(binned_triangle{
+                    { polygon[0], polygon[i], polygon[i + 1] },
+                    vertex_data,
+                    vertex_id / 3,
+                    source_id
+                });
+                binned_sources = source_id + 1;
+                for (size_t bin_y = first_y; bin_y <= last_y; ++bin_y) {
+                    for (size_t bin_x = first_x; bin_x <= last_x; ++bin_x) {
+                        bins[bin_y * bins_x + bin_x].triangles.push_back(binned_triangles.size() - 1);
+                    }
+                }
+            }
+            if (binned_sources == source_id) {
+                ++statistics.triangles_frustum_culled;
+            }
+        }
+    }
+
+    template<typename VB, typename RT>
+    template<typename Pipeline>
+    inline void rasterizer<VB, RT>::rasterize_bins(const Pipeline& pipeline)
+    {
+        // Back end: bins own disjoint pixels and Hi-Z tiles, so they need no locking.
+        // Upper Hi-Z levels are only read meanwhile, their stale depths are conservative
+#pragma omp parallel for schedule(dynamic)
+        for (int bin_id = 0; bin_id < static_cast<int>(bins.size()); ++bin_id) {
+            auto& bin = bins[bin_id];
+            bin.outcomes.resize(bin.triangles.size());
+            for (size_t i = 0; i < bin.triangles.size(); ++i) {
+                const auto& triangle = binned_triangles[bin.triangles[i]];
+                bin.outcomes[i] = rasterize_triangle(
+                        pipeline, triangle.corners[0], triangle.corners[1], triangle.corners[2],
+                        *triangle.vertex_data[0], *triangle.vertex_data[1], *triangle.vertex_data[2],
+                        triangle.primitive_id, &bin);
+            }
+        }
+        propagate_hi_z();
+
+        std::vector<uint8_t> outcomes(binned_sources, outcome_none);
+        for (const auto& bin : bins) {
+            for (size_t i = 0; i < bin.triangles.size(); ++i) {
+                outcomes[binned_triangles[bin.triangles[i]].source_id] |= bin.outcomes[i];
+            }
+            statistics.fragments_shaded += bin.statistics.fragments_shaded;
+            statistics.depth_tiles_accepted += bin.statistics.depth_tiles_accepted;
+        }
+        for (uint8_t outcome : outcomes) {
+            // Binned within the pixel margin, but no bin had a pixel of it
+            if (outcome == outcome_none) {
+                ++statistics.triangles_frustum_culled;
+            }
+            count_outcome(outcome);
+        }
+    }
+
+    template<typename VB, typename RT>
+    inline size_t rasterizer<VB, RT>::setup_triangle(std::array<clip_vertex, max_clip_vertices>& polygon)
+    {
+        // Clip planes as dot(plane, position) >= 0: near (z >= 0 in D3D-style
+        // clip space, see camera::get_projection_matrix) and guard band
+        static const float4 clip_planes[] = {
+            float4{ 0.f, 0.f, 1.f, 0.f },
+            float4{ 1.f, 0.f, 0.f, guard_band },
+            float4{ -1.f, 0.f, 0.f, guard_band },
+            float4{ 0.f, 1.f, 0.f, guard_band },
+            float4{ 0.f, -1.f, 0.f, guard_band },
+        };
+
+        ++statistics.triangles_submitted;
+        compact_depth_stale = true;
+
+        unsigned outside_all = ~0u;
+        unsigned outside_any = 0u;
+        for (size_t i = 0; i < 3; ++i) {
+            const float4& position = polygon[i].position;
+
+            // Bits 0-4 mirror clip_planes, bits 5-9 are the view frustum itself
+            unsigned outcode = 0u;
+            for (size_t plane_id = 0; plane_id < std::size(clip_planes); ++plane_id) {
+                if (dot(clip_planes[plane_id], position) < 0.f) {
+                    outcode |= 1u << plane_id;
+                }
+            }
+            if (position.x < -position.w) outcode |= 1u << 5;
+            if (position.x > position.w) outcode |= 1u << 6;
+            if (position.y < -position.w) outcode |= 1u << 7;
+            if (position.y > position.w) outcode |= 1u << 8;
+            if (position.z > position.w) outcode |= 1u << 9;
+
+            outside_all &= outcode;
+            outside_any |= outcode;
+        }
+
+        // All three vertices are outside of the same plane
+        if (outside_all & ((1u << 10) - 1)) {
+            ++statistics.triangles_frustum_culled;
+            return 0;
+        }
+
+        // Homogeneous 2D determinant: facing and zero area without the divide by w
+        float area = dot(
+            float3{ polygon[0].position.x, polygon[0].position.y, polygon[0].position.w },
+            cross(
+                float3{ polygon[1].position.x, polygon[1].position.y, polygon[1].position.w },
+                float3{ polygon[2].position.x, polygon[2].position.y, polygon[2].position.w }
+            )
+        );
+        if (area == 0.f) {
+            ++statistics.triangles_degenerate_culled;
+            return 0;
+        }
+        if ((culling == cull_mode::back && area < 0.f) ||
+            (culling == cull_mode::front && area > 0.f)) {
+            ++statistics.triangles_face_culled;
+            return 0;
+        }
+
+        size_t num_vertices = 3;
+        for (size_t plane_id = 0; plane_id < std::size(clip_planes) && num_vertices >= 3; ++plane_id) {
+            if (outside_any & (1u << plane_id)) {
+                num_vertices = clip_polygon(polygon, num_vertices, clip_planes[plane_id]);
+            }
+        }
+        if (num_vertices < 3) {
+            ++statistics.triangles_frustum_culled;
+            return 0;
+        }
+        return num_vertices;
+    }
+
+    template<typename VB, typename RT>
+    template<typename VS>
+    inline unsigned int rasterizer<VB, RT>::process_vertices(
+            const VS& shader, size_t num_vertexes, size_t vertex_offset,
+            cg::resource<unsigned int>* vertex_list)
+    {
+        // Only the index range referenced by the draw goes through the vertex shader
+        unsigned int min_index = UINT_MAX;
+        unsigned int max_index = 0;
+        for (size_t vertex_id = vertex_offset; vertex_id < vertex_offset + num_vertexes; ++vertex_id) {
+            unsigned int index = index_buffer->item(vertex_id);
+            min_index = std::min(min_index, index);
+            max_index = std::max(max_index, index);
+        }
+        if (min_index > max_index) {
+            return min_index;
+        }
+
+        if (transformed_vertices.size() < max_index - min_index + 1) {
+            transformed_vertices.resize(max_index - min_index + 1);
+        }
+
+        // The shader is called concurrently and must not mutate shared state
+        const VB* vertices = vertex_buffer->get_data();
+#pragma omp parallel for if (max_index - min_index > 1024)
+        for (int index = static_cast<int>(min_index); index <= static_cast<int>(max_index); ++index) {
+            const VB& vertex = vertices[vertex_list ? vertex_list->item(index) : index];
+            transformed_vertices[index - min_index] = shader(float4{ vertex.x, vertex.y, vertex.z, 1.0f }, vertex);
+        }
+        return min_index;
+    }
+
+    template<typename VB, typename RT>
+    template<typename VS>
+    inline void rasterizer<VB, RT>::process_instances(
+            const VS& shader, unsigned int min_index, unsigned int max_index,
+            size_t num_instances, size_t instance_offset)
+    {
+        size_t cache_stride = max_index - min_index + 1;
+        if (transformed_vertices.size() < cache_stride * num_instances) {
+            transformed_vertices.resize(cache_stride * num_instances);
+        }
+
+        const VB* vertices = vertex_buffer->get_data();
+        int num_items = static_cast<int>(cache_stride * num_instances);
+#pragma omp parallel for if (num_items > 1024)
+        for (int item = 0; item < num_items; ++item) {
+            size_t instance = item / cache_stride;
+            const VB& vertex = vertices[min_index + item % cache_stride];
+            transformed_vertices[item] = shader(
+                float4{ vertex.x, vertex.y, vertex.z, 1.0f }, vertex,
+                instance_buffer->item(instance_offset + instance));
+        }
+    }
+
+    template<typename VB, typename RT>
+    inline size_t rasterizer<VB, RT>::clip_polygon(
+            std::array<clip_vertex, max_clip_vertices>& polygon,
+            size_t num_vertices, const float4& plane)
+    {
+        std::array<clip_vertex, max_clip_vertices> result;
+        size_t num_result = 0;
+
+        for (size_t i = 0; i < num_vertices; ++i) {
+            const clip_vertex& current = polygon[i];
+            const clip_vertex& next = polygon[(i + 1) % num_vertices];
+            float current_distance = dot(plane, current.position);
+            float next_distance = dot(plane, next.position);
+
+            if (current_distance >= 0.f) {
+                result[num_result++] = current;
+            }
+            if ((current_distance >= 0.f) != (next_distance >= 0.f)) {
+                float t = current_distance / (current_distance - next_distance);
+                result[num_result++] = clip_vertex{
+                    current.position + (next.position - current.position) * t,
+                    current.weights + (next.weights - current.weights) * t
+                };
+            }
+        }
+
+        polygon = result;
+        return num_result;
+    }
+
+    template<typename VB, typename RT>
+    template<typename Pipeline>
+    inline typename rasterizer<VB, RT>::triangle_outcome rasterizer<VB, RT>::rasterize_triangle(
+            const Pipeline& pipeline,
+            const clip_vertex& a, const clip_vertex& b, const clip_vertex& c,
+            const VB& vertex_a, const VB& vertex_b, const VB& vertex_c,
+            size_t primitive_id, raster_bin* bin)
+    {
+        rasterizer_statistics& counters = bin ? bin->statistics : statistics;
+        std::array<float3, 3> vertices;
+        const clip_vertex* clip_vertices[] = { &a, &b, &c };
+
+        for (size_t i = 0; i < 3; ++i) {
+            const float4& position = clip_vertices[i]->position;
+            vertices[i] = float3{
+                (position.x / position.w + 1) * width / 2.f,
+                (-position.y / position.w + 1) * height / 2.f,
+                position.z / position.w
+            };
+        }
+
+        float edge = edge_function(
+            float2{ vertices[0].x, vertices[0].y },
+            float2{ vertices[1].x, vertices[1].y },
+            float2{ vertices[2].x, vertices[2].y }
+        );
+        if (edge == 0.f) {
+            return outcome_degenerate;
+        }
+        // The pixel loop expects a positive area, flip back faces that passed culling
+        if (edge < 0.f) {
+            std::swap(vertices[1], vertices[2]);
+            std::swap(clip_vertices[1], clip_vertices[2]);
+            edge = -edge;
+        }
+
+        // No pixel center (sampled at integer coordinates) lies inside the bounds,
+        // samples of multi-sampling reach up to half a pixel away from it
+        float sample_reach = sample_count > 1 ? 0.5f : 0.f;
+        float3 screen_min = min(min(vertices[0], vertices[1]), vertices[2]) - float3{ sample_reach, sample_reach, 0.f };
+        float3 screen_max = max(max(vertices[0], vertices[1]), vertices[2]) + float3{ sample_reach, sample_reach, 0.f };
+        if (std::ceil(screen_min.x) > screen_max.x || std::ceil(screen_min.y) > screen_max.y) {
+            return outcome_degenerate;
+        }
+
+        float2 bounding_box_begin{
+            std::clamp(screen_min.x, 0.f, static_cast<float>(width - 1)),
+            std::clamp(screen_min.y, 0.f, static_cast<float>(height - 1)),
+        };
+        float2 bounding_box_end{
+            std::clamp(screen_max.x, 0.f, static_cast<float>(width - 1)),
+            std::clamp(screen_max.y, 0.f, static_cast<float>(height - 1)),
+        };
+
+        size_t begin_x = static_cast<size_t>(bounding_box_begin.x);
+        size_t begin_y = static_cast<size_t>(bounding_box_begin.y);
+        size_t end_x   = static_cast<size_t>(std::ceil(bounding_box_end.x));
+        size_t end_y   = static_cast<size_t>(std::ceil(bounding_box_end.y));
+        if (bin) {
+            begin_x = std::max(begin_x, bin->begin_x);
+            begin_y = std::max(begin_y, bin->begin_y);
+            end_x   = std::min(end_x, bin->end_x);
+            end_y   = std::min(end_y, bin->end_y);
+            if (begin_x >= end_x || begin_y >= end_y) {
+                return outcome_none;
+            }
+        }
+
+        // Nothing of the triangle can be in front of the covered tiles. Quantizing keeps
+        // the bounds conservative against stored depth, as it is monotonic
+        float min_z = quantize_depth(std::min(std::min(vertices[0].z, vertices[1].z), vertices[2].z));
+        float max_z = quantize_depth(std::max(std::max(vertices[0].z, vertices[1].z), vertices[2].z));
+        if (!hi_z_test(min_z, begin_x, begin_y, end_x, end_y)) {
+            return outcome_occluded;
+        }
+
+        using Layout = typename Pipeline::layout;
+        constexpr bool depth_only = std::is_same_v<
+            std::decay_t<decltype(pipeline.pixel_shader)>, depth_only_shader>;
+        bool depth_write = depth_comparison != depth_func::equal;
+
+        // Fields outside of Layout keep the values of the provoking vertex
+        VB fragment = vertex_a;
+        float3 inverted_w{
+            1.f / clip_vertices[0]->position.w,
+            1.f / clip_vertices[1]->position.w,
+            1.f / clip_vertices[2]->position.w
+        };
+
+        // Attributes at screen weights u, v, w, then the pixel shader
+        auto shade_fragment = [&](float u, float v, float w, float depth) {
+            if constexpr (depth_only) {
+                return 0;
+            }
+            else {
+                if constexpr (Layout::size > 0) {
+                    // Perspective-correct weights in the clipped triangle,
+                    // then mapped back to the source triangle
+                    float3 perspective = float3{ u, v, w } * inverted_w;
+                    perspective /= perspective.x + perspective.y + perspective.z;
+                    float3 bary =
+                        perspective.x * clip_vertices[0]->weights +
+                        perspective.y * clip_vertices[1]->weights +
+                        perspective.z * clip_vertices[2]->weights;
+                    Layout::interpolate(fragment, vertex_a, vertex_b, vertex_c, bary);
+                }
+                ++counters.fragments_shaded;
+                // Pixel shaders may take the triangle index as a third argument
+                if constexpr (std::is_invocable_v<decltype(pipeline.pixel_shader), const VB&, float, size_t>) {
+                    return pipeline.pixel_shader(fragment, depth, primitive_id);
+                }
+                else {
+                    return pipeline.pixel_shader(fragment, depth);
+                }
+            }
+        };
+
+        for (size_t tile_y = begin_y / tile_size; tile_y * tile_size < end_y; ++tile_y) {
+            for (size_t tile_x = begin_x / tile_size; tile_x * tile_size < end_x; ++tile_x) {
+                if (!hi_z.empty() && depth_rejects(min_z, hi_z[0].max_depth[tile_y * hi_z[0].width + tile_x])) {
+                    continue;
+                }
+                materialize_tile(tile_x, tile_y);
+
+                // The whole triangle is in front of the whole tile: every fragment passes
+                bool depth_accepted =
+                    sample_count == 1 && depth_buffer && depth_comparison == depth_func::less &&
+                    max_z < tile_min_depth[tile_y * hi_z[0].width + tile_x];
+                if (depth_accepted) {
+                    ++counters.depth_tiles_accepted;
+                }
+
+                size_t tile_end_x = std::min(end_x, (tile_x + 1) * tile_size);
+                size_t tile_end_y = std::min(end_y, (tile_y + 1) * tile_size);
+
+                bool depth_written = false;
+                for (size_t y = std::max(begin_y, tile_y * tile_size); y < tile_end_y; ++y) {
+                    for (size_t x = std::max(begin_x, tile_x * tile_size); x < tile_end_x; ++x) {
+                        float2 point{ static_cast<float>(x), static_cast<float>(y) };
+                        float edge0 = edge_function(
+                            float2{ vertices[0].x, vertices[0].y },
+                            float2{ vertices[1].x, vertices[1].y },
+                            point
+                        );
+                        float edge1 = edge_function(
+                            float2{ vertices[1].x, vertices[1].y },
+                            float2{ vertices[2].x, vertices[2].y },
+                            point
+                        );
+                        float edge2 = edge_function(
+                            float2{ vertices[2].x, vertices[2].y },
+                            float2{ vertices[0].x, vertices[0].y },
+                            point
+                        );
+
+                        float u = edge1 / edge;
+                        float v = edge2 / edge;
+                        float w = edge0 / edge;
+                        float depth =
+                            u * vertices[0].z +
+                            v * vertices[1].z +
+                            w * vertices[2].z;
+
+                        if (sample_count > 1) {
+                            // Coverage and depth per sample, shading once per pixel at its center
+                            unsigned int coverage = 0;
+                            std::array<float, max_samples> depths;
+                            float* pixel_depths = &sample_depths[(y * width + x) * sample_count];
+                            for (size_t sample = 0; sample < sample_count; ++sample) {
+                                float2 sample_point = point + sample_offsets[sample];
+                                float sample_edge0 = edge_function(
+                                    float2{ vertices[0].x, vertices[0].y },
+                                    float2{ vertices[1].x, vertices[1].y },
+                                    sample_point
+                                );
+                                float sample_edge1 = edge_function(
+                                    float2{ vertices[1].x, vertices[1].y },
+                                    float2{ vertices[2].x, vertices[2].y },
+                                    sample_point
+                                );
+                                float sample_edge2 = edge_function(
+                                    float2{ vertices[2].x, vertices[2].y },
+                                    float2{ vertices[0].x, vertices[0].y },
+                                    sample_point
+                                );
+                                if (sample_edge0 < 0 || sample_edge1 < 0 || sample_edge2 < 0) {
+                                    continue;
+                                }
+                                depths[sample] =
+                                    sample_edge1 / edge * vertices[0].z +
+                                    sample_edge2 / edge * vertices[1].z +
+                                    sample_edge0 / edge * vertices[2].z;
+                                if (depth_passes(pixel_depths[sample], depths[sample])) {
+                                    coverage |= 1u << sample;
+                                }
+                            }
+                            if (coverage == 0) {
+                                continue;
+                            }
+
+                            if constexpr (!depth_only) {
+                                auto result = shade_fragment(u, v, w, depth);
+                                if constexpr (std::is_same_v<decltype(result), cg::color>) {
+                                    write_samples(x, y, coverage, result);
+                                }
+                                else {
+                                    write_pixel(x, y, result);
+                                }
+                            }
+                            if (depth_write) {
+                                float farthest = 0.f;
+                                for (size_t sample = 0; sample < sample_count; ++sample) {
+                                    if (coverage & (1u << sample)) {
+                                        pixel_depths[sample] = depths[sample];
+                                    }
+                                    farthest = std::max(farthest, pixel_depths[sample]);
+                                }
+                                if (depth_buffer) {
+                                    write_depth(x, y, farthest);
+                                    depth_written = true;
+                                }
+                            }
+                            continue;
+                        }
+
+                        bool inside_triangle = (edge0 >= 0) && (edge1 >= 0) && (edge2 >= 0);
+                        if (!inside_triangle || (!depth_accepted && !depth_test(depth, x, y))) {
+                            continue;
+                        }
+
+                        if constexpr (!depth_only) {
+                            write_pixel(x, y, shade_fragment(u, v, w, depth));
+                        }
+                        if (depth_write && depth_buffer) {
+                            write_depth(x, y, depth);
+                            depth_written = true;
+                        }
+                    }
+                }
+                if (depth_written) {
+                    update_hi_z(tile_x, tile_y, bin == nullptr);
+                }
+            }
+        }
+        return outcome_rasterized;
+    }
+
+    template<typename VB, typename RT>
+    template<typename LS>
+    inline void rasterizer<VB, RT>::shade_gbuffer(const LS& lighting_shader)
+    {
+        flush();
+        size_t buffer_width  = geometry_buffer->material_id->get_stride();
+        size_t buffer_height = geometry_buffer->material_id->get_number_of_elements() / buffer_width;
+
+        long long pixels_lit = 0;
+#pragma omp parallel for reduction(+ : pixels_lit)
+        for (int y = 0; y < static_cast<int>(buffer_height); ++y) {
+            for (size_t x = 0; x < buffer_width; ++x) {
+                gbuffer_sample sample{
+                    geometry_buffer->normal->item(x, y),
+                    geometry_buffer->albedo->item(x, y),
+                    geometry_buffer->material_id->item(x, y)
+                };
+                if (sample.material_id == gbuffer::empty_material) {
+                    continue;
+                }
+                float depth = geometry_buffer->depth->item(x, y);
+                render_target->item(x, y) = RT::from_color(
+                    lighting_shader(sample, depth, x, static_cast<size_t>(y)));
+                ++pixels_lit;
+            }
+        }
+        statistics.pixels_lit += static_cast<size_t>(pixels_lit);
+    }
+
+    template<typename VB, typename RT>
+    template<typename Pipeline>
+    inline void rasterizer<VB, RT>::resolve_visibility(
+            const Pipeline& pipeline,
+            const std::vector<std::shared_ptr<cg::resource<VB>>>& vertex_buffers,
+            const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& index_buffers)
+    {
+        using Layout = typename Pipeline::layout;
+        flush();
+
+        size_t buffer_width  = visibility_buffer->get_stride();
+        size_t buffer_height = visibility_buffer->get_number_of_elements() / buffer_width;
+
+        long long pixels_lit = 0;
+#pragma omp parallel for reduction(+ : pixels_lit)
+        for (int y = 0; y < static_cast<int>(buffer_height); ++y) {
+            for (size_t x = 0; x < buffer_width; ++x) {
+                visibility_sample sample{ visibility_buffer->item(x, y) };
+                if (sample.id == visibility_sample::empty) {
+                    continue;
+                }
+
+                auto& vertex_buffer = vertex_buffers[sample.shape_id()];
+                auto& index_buffer = index_buffers[sample.shape_id()];
+                std::array<std::pair<float4, VB>, 3> vertices;
+                for (size_t i = 0; i < 3; ++i) {
+                    const VB& vertex = vertex_buffer->item(index_buffer->item(sample.triangle_id() * 3 + i));
+                    vertices[i] = pipeline.vertex_shader(float4{ vertex.x, vertex.y, vertex.z, 1.0f }, vertex);
+                }
+
+                // 2D homogeneous edge functions at the pixel give perspective-correct
+                // barycentrics straight from clip space
+                float3 pixel{
+                    2.f * x / width - 1.f,
+                    1.f - 2.f * y / height,
+                    1.f
+                };
+                std::array<float3, 3> clip_positions;
+                for (size_t i = 0; i < 3; ++i) {
+                    clip_positions[i] = float3{ vertices[i].first.x, vertices[i].first.y, vertices[i].first.w };
+                }
+                float3 bary{
+                    dot(pixel, cross(clip_positions[1], clip_positions[2])),
+                    dot(pixel, cross(clip_positions[2], clip_positions[0])),
+                    dot(pixel, cross(clip_positions[0], clip_positions[1]))
+                };
+                bary /= bary.x + bary.y + bary.z;
+
+                VB fragment = vertices[0].second;
+                Layout::interpolate(fragment, vertices[0].second, vertices[1].second, vertices[2].second, bary);
+
+                float depth = depth_buffer->item(x, y);
+                if constexpr (std::is_invocable_v<decltype(pipeline.pixel_shader), const VB&, float, size_t>) {
+                    render_target->item(x, y) = RT::from_color(
+                        pipeline.pixel_shader(fragment, depth, sample.triangle_id()));
+                }
+                else {
+                    render_target->item(x, y) = RT::from_color(pipeline.pixel_shader(fragment, depth));
+                }
+                ++pixels_lit;
+            }
+        }
+        statistics.pixels_lit += static_cast<size_t>(pixels_lit);
+    }
+
+    template<typename VB, typename RT>
+    template<typename LodChain>
+    inline size_t rasterizer<VB, RT>::select_lod(
+            const LodChain& lods, const cg::world::bounding_sphere& sphere, const float4x4& matrix) const
+    {
+        // With rigid view and world transforms the w row measures view depth and the
+        // y row scales lengths by the vertical focal length
+        float4x4 rows = transpose(matrix);
+        float3 depth_axis{ rows[3].x, rows[3].y, rows[3].z };
+        float3 focal_axis{ rows[1].x, rows[1].y, rows[1].z };
+        float nearest_w = dot(depth_axis, sphere.center) + rows[3].w - sphere.radius * length(depth_axis);
+        if (nearest_w <= 0.f || lod_threshold <= 0.f) {
+            return 0;
+        }
+        float pixels_per_unit = length(focal_axis) * height / 2.f / nearest_w;
+
+        size_t lod_id = 0;
+        while (lod_id + 1 < lods.size() && lods[lod_id + 1].error * pixels_per_unit <= lod_threshold) {
+            ++lod_id;
+        }
+        return lod_id;
+    }
+
+    // Every triangle of the meshlet faces the culled side as seen from anywhere in its sphere
+    template<typename VB, typename RT>
+    inline bool rasterizer<VB, RT>::is_cone_culled(const cg::world::meshlet& meshlet, const float3& eye) const
+    {
+        if (culling == cull_mode::none) {
+            return false;
+        }
+        float3 axis = culling == cull_mode::back ? meshlet.cone.axis : -meshlet.cone.axis;
+        float3 to_center = meshlet.sphere.center - eye;
+        return dot(to_center, axis) >= meshlet.cone.cutoff * length(to_center) + meshlet.sphere.radius;
+    }
+
+    template<typename VB, typename RT>
+    inline bool rasterizer<VB, RT>::is_occluded(
+            float3 aabb_min, float3 aabb_max, const float4x4& matrix)
+    {
+        if (hi_z.empty()) {
+            return false;
+        }
+
+        float2 screen_min{ FLT_MAX, FLT_MAX };
+        float2 screen_max{ -FLT_MAX, -FLT_MAX };
+        float min_z = FLT_MAX;
+        for (size_t corner_id = 0; corner_id < 8; ++corner_id) {
+            float4 corner{
+                (corner_id & 1) ? aabb_max.x : aabb_min.x,
+                (corner_id & 2) ? aabb_max.y : aabb_min.y,
+                (corner_id & 4) ? aabb_max.z : aabb_min.z,
+                1.0f
+            };
+            float4 projected = mul(matrix, corner);
+            // The box reaches behind the camera, its projection is unbounded
+            if (projected.w <= 0.0f) {
+                return false;
+            }
+
+            float2 screen{
+                (projected.x / projected.w + 1) * width / 2.f,
+                (-projected.y / projected.w + 1) * height / 2.f
+            };
+            screen_min = min(screen_min, screen);
+            screen_max = max(screen_max, screen);
+            min_z = std::min(min_z, projected.z / projected.w);
+        }
+
+        if (screen_max.x < 0.f || screen_max.y < 0.f ||
+            screen_min.x > static_cast<float>(width - 1) ||
+            screen_min.y > static_cast<float>(height - 1)) {
+            return false;
+        }
+
+        return !hi_z_test(
+            quantize_depth(min_z),
+            static_cast<size_t>(std::max(screen_min.x, 0.f)),
+            static_cast<size_t>(std::max(screen_min.y, 0.f)),
+            static_cast<size_t>(std::ceil(std::min(screen_max.x, static_cast<float>(width - 1)))) + 1,
+            static_cast<size_t>(std::ceil(std::min(screen_max.y, static_cast<float>(height - 1)))) + 1
+        );
+    }
+
+    template<typename VB, typename RT>
+    inline float
+    rasterizer<VB, RT>::edge_function(float2 a, float2 b, float2 c)
+    {
+        return (c.x - a.x) * (b.y - a.y) - (c.y - a.y) * (b.x - a.x);
+    }
+
+    template<typename VB, typename RT>
+    inline bool rasterizer<VB, RT>::depth_test(float z, size_t x, size_t y)
+    {
+        if (!depth_buffer) {
+            return true;
+        }
+        return depth_passes(read_depth(x, y), quantize_depth(z));
+    }
+
+    template<typename VB, typename RT>
+    inline float rasterizer<VB, RT>::read_depth(size_t x, size_t y)
+    {
+        size_t pixel = y * width + x;
+        switch (depth_storage) {
+            case depth_format::unorm24: {
+                const uint8_t* bytes = &depth24[pixel * 3];
+                return decode_depth(bytes[0] | (bytes[1] << 8) | (bytes[2] << 16));
+            }
+            case depth_format::unorm16:
+                return decode_depth(depth16[pixel]);
+            default:
+                return depth_buffer->item(x, y);
+        }
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::write_depth(size_t x, size_t y, float z)
+    {
+        size_t pixel = y * width + x;
+        switch (depth_storage) {
+            case depth_format::unorm24: {
+                uint32_t code = encode_depth(z);
+                uint8_t* bytes = &depth24[pixel * 3];
+                bytes[0] = static_cast<uint8_t>(code);
+                bytes[1] = static_cast<uint8_t>(code >> 8);
+                bytes[2] = static_cast<uint8_t>(code >> 16);
+                break;
+            }
+            case depth_format::unorm16:
+                depth16[pixel] = static_cast<uint16_t>(encode_depth(z));
+                break;
+            default:
+                depth_buffer->item(x, y) = z;
+                break;
+        }
+    }
+
+    template<typename VB, typename RT>
+    inline float rasterizer<VB, RT>::quantize_depth(float z) const
+    {
+        if (depth_storage == depth_format::float32) {
+            return z;
+        }
+        return decode_depth(encode_depth(z));
+    }
+
+    // Depth outside of [0, 1], the FLT_MAX clear value included, saturates
+    template<typename VB, typename RT>
+    inline uint32_t rasterizer<VB, RT>::encode_depth(float z) const
+    {
+        double max_code = depth_storage == depth_format::unorm16 ? 0xFFFF : 0xFFFFFF;
+        return static_cast<uint32_t>(std::clamp(static_cast<double>(z), 0.0, 1.0) * max_code + 0.5);
+    }
+
+    template<typename VB, typename RT>
+    inline float rasterizer<VB, RT>::decode_depth(uint32_t code) const
+    {
+        double max_code = depth_storage == depth_format::unorm16 ? 0xFFFF : 0xFFFFFF;
+        return static_cast<float>(code / max_code);
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::allocate_depth()
+    {
+        depth16.assign(depth_storage == depth_format::unorm16 ? width * height : 0, 0xFFFF);
+        depth24.assign(depth_storage == depth_format::unorm24 ? width * height * 3 : 0, 0xFF);
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::load_depth()
+    {
+        if (depth_storage == depth_format::float32 || !depth_buffer) {
+            return;
+        }
+#pragma omp parallel for
+        for (int y = 0; y < static_cast<int>(height); ++y) {
+            for (size_t x = 0; x < width; ++x) {
+                write_depth(x, y, depth_buffer->item(x, y));
+            }
+        }
+        compact_depth_stale = false;
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::store_depth()
+    {
+        if (depth_storage == depth_format::float32 || !depth_buffer || !compact_depth_stale) {
+            return;
+        }
+#pragma omp parallel for
+        for (int y = 0; y < static_cast<int>(height); ++y) {
+            for (size_t x = 0; x < width; ++x) {
+                depth_buffer->item(x, y) = read_depth(x, y);
+            }
+        }
+        compact_depth_stale = false;
+    }
+
+    template<typename VB, typename RT>
+    inline bool rasterizer<VB, RT>::depth_passes(float stored, float z) const
+    {
+        if (depth_comparison == depth_func::equal) {
+            return stored == z;
+        }
+        return stored > z;
+    }
+
+    // True when no fragment at or behind min_z can pass against max_depth
+    template<typename VB, typename RT>
+    inline bool rasterizer<VB, RT>::depth_rejects(float min_z, float max_depth) const
+    {
+        // Bounds come from vertices while stored depth is interpolated, so an equal
+        // pass has to tolerate a few ulps of rounding
+        if (depth_comparison == depth_func::equal) {
+            return max_depth < min_z - equal_depth_tolerance;
+        }
+        return max_depth <= min_z;
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::write_pixel(size_t x, size_t y, const cg::color& color)
+    {
+        render_target->item(x, y) = RT::from_color(color);
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::write_pixel(size_t x, size_t y, const gbuffer_sample& sample)
+    {
+        geometry_buffer->normal->item(x, y) = sample.normal;
+        geometry_buffer->albedo->item(x, y) = sample.albedo;
+        geometry_buffer->material_id->item(x, y) = sample.material_id;
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::write_pixel(size_t x, size_t y, const visibility_sample& sample)
+    {
+        visibility_buffer->item(x, y) = sample.id;
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::write_samples(
+            size_t x, size_t y, unsigned int coverage, const cg::color& color)
+    {
+        size_t pixel = y * width + x;
+        cg::color* colors = &fragment_colors[pixel * sample_count];
+        uint32_t& indexes = fragment_indexes[pixel];
+        uint8_t& count = fragment_counts[pixel];
+
+        // Fully covered: back to a single color
+        if (coverage == (1u << sample_count) - 1) {
+            colors[0] = color;
+            indexes = 0;
+            count = 1;
+            return;
+        }
+
+        // No free slot: drop the colors no uncovered sample refers to anymore
+        if (count == sample_count) {
+            std::array<cg::color, max_samples> kept_colors;
+            std::array<uint8_t, max_samples> remap;
+            remap.fill(UINT8_MAX);
+            uint8_t kept = 0;
+            uint32_t kept_indexes = 0;
+            for (size_t sample = 0; sample < sample_count; ++sample) {
+                if (coverage & (1u << sample)) {
+                    continue;
+                }
+                uint32_t index = (indexes >> (4 * sample)) & 0xF;
+                if (remap[index] == UINT8_MAX) {
+                    remap[index] = kept;
+                    kept_colors[kept++] = colors[index];
+                }
+                kept_indexes |= static_cast<uint32_t>(remap[index]) << (4 * sample);
+            }
+            std::copy(kept_colors.begin(), kept_colors.begin() + kept, colors);
+            indexes = kept_indexes;
+            count = kept;
+        }
+
+        uint32_t index = count++;
+        colors[index] = color;
+        for (size_t sample = 0; sample < sample_count; ++sample) {
+            if (coverage & (1u << sample)) {
+                indexes = (indexes & ~(0xFu << (4 * sample))) | (index << (4 * sample));
+            }
+        }
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::build_hi_z()
+    {
+        size_t level_width  = depth_buffer->get_stride();
+        size_t level_height = depth_buffer->get_number_of_elements() / level_width;
+        size_t level_tile   = tile_size;
+
+        hi_z.clear();
+        do {
+            level_width  = (level_width  + level_tile - 1) / level_tile;
+            level_height = (level_height + level_tile - 1) / level_tile;
+            hi_z.push_back(hi_z_level{
+                level_width, level_height,
+                std::vector<float>(level_width * level_height, FLT_MAX)
+            });
+            level_tile = 2;
+        } while (level_width > 1 || level_height > 1);
+        tile_min_depth.assign(hi_z[0].max_depth.size(), FLT_MAX);
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::update_hi_z(size_t tile_x, size_t tile_y, bool propagate)
+    {
+        size_t buffer_width  = depth_buffer->get_stride();
+        size_t buffer_height = depth_buffer->get_number_of_elements() / buffer_width;
+
+        float min_depth = FLT_MAX;
+        float max_depth = -FLT_MAX;
+        for (size_t y = tile_y * tile_size; y < std::min((tile_y + 1) * tile_size, buffer_height); ++y) {
+            for (size_t x = tile_x * tile_size; x < std::min((tile_x + 1) * tile_size, buffer_width); ++x) {
+                float depth = read_depth(x, y);
+                min_depth = std::min(min_depth, depth);
+                max_depth = std::max(max_depth, depth);
+            }
+        }
+        hi_z[0].max_depth[tile_y * hi_z[0].width + tile_x] = max_depth;
+        tile_min_depth[tile_y * hi_z[0].width + tile_x] = min_depth;
+
+        for (size_t level_id = 1; level_id < hi_z.size() && propagate; ++level_id) {
+            const auto& child = hi_z[level_id - 1];
+            auto& level = hi_z[level_id];
+            tile_x /= 2;
+            tile_y /= 2;
+
+            float level_depth = -FLT_MAX;
+            for (size_t y = tile_y * 2; y < std::min(tile_y * 2 + 2, child.height); ++y) {
+                for (size_t x = tile_x * 2; x < std::min(tile_x * 2 + 2, child.width); ++x) {
+                    level_depth = std::max(level_depth, child.max_depth[y * child.width + x]);
+                }
+            }
+
+            float& stored_depth = level.max_depth[tile_y * level.width + tile_x];
+            if (stored_depth == level_depth) {
+                break;
+            }
+            stored_depth = level_depth;
+        }
+    }
+
+    template<typename VB, typename RT>
+    inline void rasterizer<VB, RT>::propagate_hi_z()
+    {
+        for (size_t level_id = 1; level_id < hi_z.size(); ++level_id) {
+            const auto& child = hi_z[level_id - 1];
+            auto& level = hi_z[level_id];
+            for (size_t y = 0; y < level.height; ++y) {
+                for (size_t x = 0; x < level.width; ++x) {
+                    float level_depth = -FLT_MAX;
+                    for (size_t child_y = y * 2; child_y < std::min(y * 2 + 2, child.height); ++child_y) {
+                        for (size_t child_x = x * 2; child_x < std::min(x * 2 + 2, child.width); ++child_x) {
+                            level_depth = std::max(level_depth, child.max_depth[child_y * child.width + child_x]);
+                        }
+                    }
+                    level.max_depth[y * level.width + x] = level_depth;
+                }
+            }
+        }
+    }
+
+    template<typename VB, typename RT>
+    inline bool rasterizer<VB, RT>::hi_z_test(
+            float min_z, size_t begin_x, size_t begin_y, size_t end_x, size_t end_y)
+    {
+        if (hi_z.empty() || begin_x >= end_x || begin_y >= end_y) {
+            return true;
+        }
+
+        // Pick the finest level where the rectangle spans at most 2x2 texels
+        size_t level_id = 0;
+        size_t texel_size = tile_size;
+        while (level_id + 1 < hi_z.size() &&
+               ((end_x - 1) / texel_size - begin_x / texel_size > 1 ||
+                (end_y - 1) / texel_size - begin_y / texel_size > 1)) {
+            ++level_id;
+            texel_size *= 2;
+        }
+
+        const auto& level = hi_z[level_id];
+        for (size_t y = begin_y / texel_size; y <= (end_y - 1) / texel_size; ++y) {
+            for (size_t x = begin_x / texel_size; x <= (end_x - 1) / texel_size; ++x) {
+                if (!depth_rejects(min_z, level.max_depth[y * level.width + x])) {
+                    return true;
+                }
+            }
         }
-        return depth_buffer->item(x, y) > z;
+        return false;
     }
 
 }// namespace cg::renderer
\ No newline at end of file
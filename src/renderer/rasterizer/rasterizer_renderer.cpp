@@ -1,7 +1,12 @@
 #include "rasterizer_renderer.h"
 
+#include "utils/error_handler.h"
 #include "utils/resource_utils.h"
 
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
 
 void cg::renderer::rasterization_renderer::init()
 {
@@ -28,6 +33,144 @@ void cg::renderer::rasterization_renderer::init()
 
 	rasterizer->set_render_target(render_target, depth_buffer);
 	rasterizer->set_viewport(settings->width, settings->height);
+	rasterizer->set_lod_threshold(settings->lod_threshold);
+	rasterizer->set_sample_count(settings->msaa);
+	if (settings->depth_format == "unorm24") {
+		rasterizer->set_depth_format(cg::renderer::depth_format::unorm24);
+	}
+	else if (settings->depth_format == "unorm16") {
+		rasterizer->set_depth_format(cg::renderer::depth_format::unorm16);
+	}
+	else if (settings->depth_format != "float32") {
+		THROW_ERROR("Unknown depth format: " + settings->depth_format);
+	}
+
+	if (settings->shading == "deferred") {
+		gbuffer = std::make_shared<cg::renderer::gbuffer>(settings->width, settings->height);
+		rasterizer->set_gbuffer(gbuffer);
+	}
+	else if (settings->shading == "visibility") {
+		if (model->get_index_buffers().size() > cg::renderer::visibility_sample::max_shapes) {
+			THROW_ERROR("Too many shapes for the visibility buffer");
+		}
+		for (const auto& index_buffer : model->get_index_buffers()) {
+			if (index_buffer->get_number_of_elements() / 3 > cg::renderer::visibility_sample::max_triangles) {
+				THROW_ERROR("Too many triangles in a shape for the visibility buffer");
+			}
+		}
+		visibility_buffer = std::make_shared<cg::resource<unsigned int>>(settings->width, settings->height);
+		rasterizer->set_visibility_buffer(visibility_buffer);
+	}
+	else if (settings->shading != "forward") {
+		THROW_ERROR("Unknown shading: " + settings->shading);
+	}
+
+	for (const auto& vertex_buffer : model->get_vertex_buffers()) {
+		const auto& vertex = vertex_buffer->item(0);
+		shape_ambient.push_back(float3{ vertex.ambient_r, vertex.ambient_g, vertex.ambient_b });
+	}
+
+	// Baked light of the static scene goes into the vertex ambient and replaces the
+	// point light, which it already contains along with its shadows and bounces
+	if (!settings->irradiance_cache.empty()) {
+		if (gbuffer) {
+			THROW_ERROR("Baked irradiance is per vertex, deferred shading keeps one ambient per shape");
+		}
+		cg::renderer::irradiance_cache cache;
+		cache.load(settings->irradiance_cache, model->get_vertex_buffers());
+		for (size_t shape_id = 0; shape_id < model->get_vertex_buffers().size(); ++shape_id) {
+			auto& vertex_buffer = *model->get_vertex_buffers()[shape_id];
+			for (size_t vertex_id = 0; vertex_id < vertex_buffer.get_number_of_elements(); ++vertex_id) {
+				auto& vertex = vertex_buffer.item(vertex_id);
+				float3 baked = float3{ vertex.diffuse_r, vertex.diffuse_g, vertex.diffuse_b } * cache.item(shape_id, vertex_id);
+				vertex.ambient_r = baked.x;
+				vertex.ambient_g = baked.y;
+				vertex.ambient_b = baked.z;
+			}
+		}
+	}
+	else if (settings->point_light) {
+		// The light of the Raytracing target, without it shapes show their ambient only
+		lights.push_back({
+			float3{ 0, 1.58f, -0.03f },
+			float3{ 0.78f, 0.78f, 0.78f },
+		});
+	}
+	if (!settings->sun_direction.empty()) {
+		if (settings->sun_direction.size() != 3) {
+			THROW_ERROR("Sun direction needs 3 components");
+		}
+		directional_lights.push_back({
+			float3{ settings->sun_direction[0], settings->sun_direction[1], settings->sun_direction[2] },
+			float3{ 0.78f, 0.78f, 0.78f },
+		});
+	}
+
+	scene_bounds = { float3{ FLT_MAX, FLT_MAX, FLT_MAX }, float3{ -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+	for (const auto& bounding_box : model->get_bounding_boxes()) {
+		scene_bounds.min = min(scene_bounds.min, bounding_box.min);
+		scene_bounds.max = max(scene_bounds.max, bounding_box.max);
+	}
+
+	if (settings->instances > 1) {
+		if (visibility_buffer) {
+			THROW_ERROR("Visibility buffer can not tell instances apart");
+		}
+		if (settings->record_threads > 0) {
+			THROW_ERROR("Command lists do not record instanced draws");
+		}
+		// Square grid going away from the camera, the first copy stays in place
+		float3 spacing = (scene_bounds.max - scene_bounds.min) * 1.25f;
+		size_t columns = static_cast<size_t>(std::ceil(std::sqrt(static_cast<float>(settings->instances))));
+		cg::world::bounding_box grid_bounds = scene_bounds;
+		for (size_t instance = 0; instance < settings->instances; ++instance) {
+			float3 offset{
+				static_cast<float>(instance % columns) * spacing.x,
+				0.f,
+				-static_cast<float>(instance / columns) * spacing.z
+			};
+			instance_transforms.push_back(float4x4{
+				{ 1, 0, 0, 0 },
+				{ 0, 1, 0, 0 },
+				{ 0, 0, 1, 0 },
+				{ offset.x, offset.y, offset.z, 1 }
+			});
+			grid_bounds.min = min(grid_bounds.min, scene_bounds.min + offset);
+			grid_bounds.max = max(grid_bounds.max, scene_bounds.max + offset);
+		}
+		scene_bounds = grid_bounds;
+		instance_buffer = std::make_shared<cg::resource<float4x4>>(instance_transforms.size());
+		rasterizer->set_instance_buffer(instance_buffer);
+	}
+
+	if (settings->shadows) {
+		shadow_rasterizer = std::make_shared<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>>();
+		shadow_rasterizer->set_viewport(settings->shadow_map_size, settings->shadow_map_size);
+		// Single-sided walls have to cast from both sides
+		shadow_rasterizer->set_cull_mode(cg::renderer::cull_mode::none);
+		shadow_rasterizer->set_lod_threshold(0.f);
+		shadow_rasterizer->set_instance_buffer(instance_buffer);
+
+		float scene_extent = length(scene_bounds.max - scene_bounds.min);
+		for (const auto& light : lights) {
+			shadow_maps.emplace_back(settings->shadow_map_size);
+			shadow_maps.back().set_point_light(light.position, 0.01f, scene_extent);
+		}
+		directional_shadow_maps.assign(directional_lights.size(), cg::renderer::shadow_map(settings->shadow_map_size));
+	}
+
+	if (settings->cull_mode == "none") {
+		rasterizer->set_cull_mode(cg::renderer::cull_mode::none);
+	}
+	else if (settings->cull_mode == "back") {
+		rasterizer->set_cull_mode(cg::renderer::cull_mode::back);
+	}
+	else if (settings->cull_mode == "front") {
+		rasterizer->set_cull_mode(cg::renderer::cull_mode::front);
+	}
+	else {
+		THROW_ERROR("Unknown cull mode: " + settings->cull_mode);
+	}
 
 }
 
@@ -37,6 +180,7 @@ void cg::renderer::rasterization_renderer::update() {}
 
 void cg::renderer::rasterization_renderer::render()
 {
+	auto start = std::chrono::high_resolution_clock::now();
 	rasterizer->clear_render_target(unsigned_color{ 100, 149, 237 });
 
 	float4x4 matrix = mul(
@@ -44,23 +188,390 @@ void cg::renderer::rasterization_renderer::render()
 		camera->get_view_matrix(),
 		model->get_world_matrix()
 	);
-	rasterizer->vertex_shader = [&](float4 vertex, cg::vertex vertex_data) {
+	// Vertex shader of instanced draws: the vertex data moves with the instance,
+	// as pixel shaders light in world space
+	auto make_instance_vertex_shader = [](const float4x4& view_matrix) {
+		return [view_matrix](float4 vertex, const cg::vertex& vertex_data, const float4x4& instance) {
+			float4 position = mul(instance, vertex);
+			float4 normal = mul(instance, float4{ vertex_data.nx, vertex_data.ny, vertex_data.nz, 0.f });
+			cg::vertex result = vertex_data;
+			result.x = position.x;
+			result.y = position.y;
+			result.z = position.z;
+			result.nx = normal.x;
+			result.ny = normal.y;
+			result.nz = normal.z;
+			return std::make_pair(mul(view_matrix, position), result);
+		};
+	};
+
+	// Instances in the view of view_matrix, grouped so that every shape and LOD is one draw
+	size_t instances_culled = 0;
+	size_t instanced_draws = 0;
+	auto draw_instances = [&](auto& target, const float4x4& view_matrix, const auto& make_shape_pipeline) {
+		instances_culled = 0;
+		instanced_draws = 0;
+		std::vector<std::vector<float4x4>> lod_instances;
+		for (size_t shape_id = 0; shape_id < model->get_index_buffers().size(); ++shape_id) {
+			const auto& lods = model->get_lods()[shape_id];
+			const auto& bounding_sphere = model->get_bounding_spheres()[shape_id];
+			const auto& bounding_box = model->get_bounding_boxes()[shape_id];
+			lod_instances.assign(lods.size(), {});
+			for (const auto& transform : instance_transforms) {
+				float4x4 instance_matrix = mul(view_matrix, transform);
+				if (!cg::world::frustum::from_matrix(instance_matrix).intersects(bounding_sphere) ||
+					target.is_occluded(bounding_box.min, bounding_box.max, instance_matrix)) {
+					++instances_culled;
+					continue;
+				}
+				lod_instances[target.select_lod(lods, bounding_sphere, instance_matrix)].push_back(transform);
+			}
+
+			target.set_vertex_buffer(model->get_vertex_buffers()[shape_id]);
+			size_t instance_offset = 0;
+			for (size_t lod_id = 0; lod_id < lods.size(); ++lod_id) {
+				const auto& transforms = lod_instances[lod_id];
+				if (transforms.empty()) {
+					continue;
+				}
+				for (size_t i = 0; i < transforms.size(); ++i) {
+					instance_buffer->item(instance_offset + i) = transforms[i];
+				}
+				target.set_index_buffer(lods[lod_id].index_buffer);
+				target.draw_instanced(
+					make_shape_pipeline(shape_id),
+					lods[lod_id].index_buffer->get_number_of_elements(), 0,
+					transforms.size(), instance_offset);
+				instance_offset += transforms.size();
+				++instanced_draws;
+			}
+		}
+	};
+
+	size_t shadow_triangles = 0;
+	auto render_shadow_map = [&](const cg::renderer::shadow_map& shadow_map) {
+		for (const auto& view : shadow_map.get_views()) {
+			shadow_rasterizer->set_render_target(nullptr, view.depth);
+			shadow_rasterizer->clear_render_target({});
+
+			float4x4 light_matrix = mul(view.matrix, model->get_world_matrix());
+			if (instance_buffer) {
+				draw_instances(*shadow_rasterizer, light_matrix, [&](size_t) {
+					return cg::renderer::make_depth_pipeline_state(make_instance_vertex_shader(light_matrix));
+				});
+				shadow_triangles += shadow_rasterizer->get_statistics().triangles_rasterized;
+				shadow_rasterizer->flush();
+				continue;
+			}
+
+			auto light_frustum = cg::world::frustum::from_matrix(light_matrix);
+			auto depth_pipeline = cg::renderer::make_depth_pipeline_state(
+				[&](float4 vertex, const cg::vertex& vertex_data) {
+					return std::make_pair(mul(light_matrix, vertex), vertex_data);
+				}
+			);
+			for (size_t shape_id = 0; shape_id < model->get_index_buffers().size(); ++shape_id) {
+				if (!light_frustum.intersects(model->get_bounding_spheres()[shape_id])) {
+					continue;
+				}
+				const auto& lod = model->get_lods()[shape_id].front();
+				shadow_rasterizer->set_vertex_buffer(model->get_vertex_buffers()[shape_id]);
+				shadow_rasterizer->set_index_buffer(lod.meshlet_indexes);
+				shadow_rasterizer->draw_meshlets(depth_pipeline, lod.meshlets, *lod.meshlet_vertices, light_matrix);
+			}
+			shadow_triangles += shadow_rasterizer->get_statistics().triangles_rasterized;
+			// Lookups read the depth outside of the rasterizer
+			shadow_rasterizer->flush();
+		}
+	};
+	for (const auto& shadow_map : shadow_maps) {
+		render_shadow_map(shadow_map);
+	}
+	for (size_t light_id = 0; light_id < directional_shadow_maps.size(); ++light_id) {
+		directional_shadow_maps[light_id].set_directional_light(
+			directional_lights[light_id].direction, *camera, scene_bounds, settings->shadow_cascades);
+		render_shadow_map(directional_shadow_maps[light_id]);
+	}
+
+	// Shared by the forward pixel shader and the deferred lighting pass
+	auto shade = [&](float3 position, float3 normal, float3 ambient, float3 diffuse) {
+		float3 result_color = ambient;
+		for (size_t light_id = 0; light_id < lights.size(); ++light_id) {
+			const auto& light = lights[light_id];
+			float3 to_light = normalize(light.position - position);
+			float lit = shadow_maps.empty() ? 1.f : shadow_maps[light_id].visibility(position, normal);
+			result_color += diffuse * (light.color / 2) * std::max(dot(normal, to_light), 0.0f) * lit;
+		}
+		for (size_t light_id = 0; light_id < directional_lights.size(); ++light_id) {
+			const auto& light = directional_lights[light_id];
+			float3 to_light = -normalize(light.direction);
+			float lit = directional_shadow_maps.empty() ? 1.f : directional_shadow_maps[light_id].visibility(position, normal);
+			result_color += diffuse * (light.color / 2) * std::max(dot(normal, to_light), 0.0f) * lit;
+		}
+		return cg::color::from_float3(result_color);
+	};
+
+	using layout = cg::vertex_layout<cg::vertex>;
+	auto vertex_shader = [&](float4 vertex, const cg::vertex& vertex_data) {
 		return std::make_pair(mul(matrix, vertex), vertex_data);
 	};
-	rasterizer->pixel_shader = [&](cg::vertex vertex_data, float z) {
-		return cg::color{
-			vertex_data.ambient_r,
-			vertex_data.ambient_g,
-			vertex_data.ambient_b
+	auto forward_pixel_shader = [&](const cg::vertex& vertex_data, const float z) {
+		return shade(
+			float3{ vertex_data.x, vertex_data.y, vertex_data.z },
+			normalize(float3{ vertex_data.nx, vertex_data.ny, vertex_data.nz }),
+			float3{ vertex_data.ambient_r, vertex_data.ambient_g, vertex_data.ambient_b },
+			float3{ vertex_data.diffuse_r, vertex_data.diffuse_g, vertex_data.diffuse_b }
+		);
+	};
+	// Only what shade reads is interpolated
+	using forward_layout = cg::join_layouts_t<layout::position, layout::normal, layout::ambient, layout::diffuse>;
+	auto forward_pipeline = cg::renderer::make_pipeline_state<forward_layout>(vertex_shader, forward_pixel_shader);
+	using gbuffer_layout = cg::join_layouts_t<layout::normal, layout::diffuse>;
+	auto make_visibility_pixel_shader = [](size_t shape_id) {
+		return [shape_id](const cg::vertex& vertex_data, const float z, size_t primitive_id) {
+			return cg::renderer::visibility_sample::pack(shape_id, primitive_id);
+		};
+	};
+	auto make_gbuffer_pixel_shader = [](size_t shape_id) {
+		return [shape_id](const cg::vertex& vertex_data, const float z) {
+			return cg::renderer::gbuffer_sample{
+				normalize(float3{ vertex_data.nx, vertex_data.ny, vertex_data.nz }),
+				float3{ vertex_data.diffuse_r, vertex_data.diffuse_g, vertex_data.diffuse_b },
+				static_cast<unsigned int>(shape_id)
+			};
 		};
 	};
 
+	// Frustum planes in model space, so the bounds need no transform
+	auto frustum = cg::world::frustum::from_matrix(matrix);
+	std::vector<size_t> shapes_in_frustum;
+	// Picked once per frame, so that every pass draws the same triangles
+	std::vector<size_t> selected_lods(model->get_index_buffers().size(), 0);
+	auto lod_index_buffers = model->get_index_buffers();
+	size_t shapes_simplified = 0;
 	for (size_t shape_id = 0; shape_id < model->get_index_buffers().size(); ++shape_id) {
-		rasterizer->set_vertex_buffer(model->get_vertex_buffers()[shape_id]);
-		rasterizer->set_index_buffer(model->get_index_buffers()[shape_id]);
+		const auto& bounding_sphere = model->get_bounding_spheres()[shape_id];
+		if (frustum.intersects(bounding_sphere) &&
+			frustum.intersects(model->get_bounding_boxes()[shape_id])) {
+			shapes_in_frustum.push_back(shape_id);
+
+			const auto& lods = model->get_lods()[shape_id];
+			selected_lods[shape_id] = rasterizer->select_lod(lods, bounding_sphere, matrix);
+			lod_index_buffers[shape_id] = lods[selected_lods[shape_id]].index_buffer;
+			if (selected_lods[shape_id] > 0) {
+				++shapes_simplified;
+			}
+		}
+	}
+
+	size_t shapes_occlusion_culled = 0;
+	auto for_each_visible_shape = [&](const auto& draw_shape) {
+		shapes_occlusion_culled = 0;
+		for (size_t shape_id : shapes_in_frustum) {
+			const auto& bounding_box = model->get_bounding_boxes()[shape_id];
+			if (rasterizer->is_occluded(bounding_box.min, bounding_box.max, matrix)) {
+				++shapes_occlusion_culled;
+				continue;
+			}
+
+			rasterizer->set_vertex_buffer(model->get_vertex_buffers()[shape_id]);
+			const auto& lod = model->get_lods()[shape_id][selected_lods[shape_id]];
+			rasterizer->set_index_buffer(lod.meshlet_indexes);
+			draw_shape(shape_id, lod);
+		}
+	};
+
+	auto instance_vertex_shader = make_instance_vertex_shader(matrix);
+	size_t draws_recorded = 0;
+	size_t batches_submitted = 0;
+	if (settings->record_threads > 0) {
+		cg::renderer::command_queue<cg::vertex, cg::unsigned_color> queue;
+		size_t depth_pipeline = settings->depth_prepass ?
+			queue.add_pipeline(cg::renderer::make_depth_pipeline_state(vertex_shader)) : 0;
+		auto color_depth_func = settings->depth_prepass ? cg::renderer::depth_func::equal : cg::renderer::depth_func::less;
+		// Deferred and visibility pixel shaders write the shape id, so they take a pipeline per shape
+		std::vector<size_t> color_pipelines(model->get_index_buffers().size());
+		for (size_t shape_id = 0; shape_id < color_pipelines.size(); ++shape_id) {
+			if (gbuffer) {
+				color_pipelines[shape_id] = queue.add_pipeline(
+					cg::renderer::make_pipeline_state<gbuffer_layout>(vertex_shader, make_gbuffer_pixel_shader(shape_id)),
+					color_depth_func);
+			}
+			else if (visibility_buffer) {
+				color_pipelines[shape_id] = queue.add_pipeline(
+					cg::renderer::make_pipeline_state<cg::attribute_layout<>>(vertex_shader, make_visibility_pixel_shader(shape_id)),
+					color_depth_func);
+			}
+			else {
+				color_pipelines[shape_id] = shape_id == 0 ?
+					queue.add_pipeline(forward_pipeline, color_depth_func) : color_pipelines[0];
+			}
+		}
+
+		// View depth is the w row of the matrix
+		float4x4 rows = transpose(matrix);
+		float3 depth_axis{ rows[3].x, rows[3].y, rows[3].z };
+
+		// Every thread records the meshlets of a contiguous run of shapes into its own list.
+		// Nothing is drawn while recording, so Hi-Z culling waits for the replay
+		std::vector<cg::renderer::command_list<cg::vertex>> lists(settings->record_threads);
+		size_t shapes_per_list = (shapes_in_frustum.size() + lists.size() - 1) / lists.size();
+		long long recorded = 0;
+#pragma omp parallel for reduction(+ : recorded)
+		for (int list_id = 0; list_id < static_cast<int>(lists.size()); ++list_id) {
+			auto& list = lists[list_id];
+			size_t end = std::min(shapes_in_frustum.size(), (list_id + 1) * shapes_per_list);
+			for (size_t i = list_id * shapes_per_list; i < end; ++i) {
+				size_t shape_id = shapes_in_frustum[i];
+				const auto& lod = model->get_lods()[shape_id][selected_lods[shape_id]];
+				list.set_vertex_buffer(model->get_vertex_buffers()[shape_id]);
+				list.set_index_buffer(lod.meshlet_indexes);
+				for (const auto& meshlet : lod.meshlets) {
+					float depth = dot(depth_axis, meshlet.sphere.center) + rows[3].w -
+								  meshlet.sphere.radius * length(depth_axis);
+					if (settings->depth_prepass) {
+						list.draw_meshlet(depth_pipeline, meshlet, lod.meshlet_vertices, depth);
+						++recorded;
+					}
+					list.draw_meshlet(color_pipelines[shape_id], meshlet, lod.meshlet_vertices, depth);
+					++recorded;
+				}
+			}
+		}
+		draws_recorded = static_cast<size_t>(recorded);
 
-		rasterizer->draw(model->get_index_buffers()[shape_id]->get_number_of_elements(), 0);
+		queue.submit(*rasterizer, lists, matrix);
+		batches_submitted = queue.get_batch_count();
 	}
+	else {
+		if (settings->depth_prepass) {
+			// Shaders below then run only for the nearest fragment of each pixel
+			if (instance_buffer) {
+				draw_instances(*rasterizer, matrix, [&](size_t) {
+					return cg::renderer::make_depth_pipeline_state(instance_vertex_shader);
+				});
+			}
+			else {
+				for_each_visible_shape([&](size_t, const auto& lod) {
+					rasterizer->draw_meshlets(
+						cg::renderer::make_depth_pipeline_state(vertex_shader), lod.meshlets, *lod.meshlet_vertices, matrix);
+				});
+			}
+			rasterizer->set_depth_func(cg::renderer::depth_func::equal);
+		}
+
+		if (instance_buffer && gbuffer) {
+			draw_instances(*rasterizer, matrix, [&](size_t shape_id) {
+				return cg::renderer::make_pipeline_state<gbuffer_layout>(
+					instance_vertex_shader, make_gbuffer_pixel_shader(shape_id));
+			});
+		}
+		else if (instance_buffer) {
+			draw_instances(*rasterizer, matrix, [&](size_t) {
+				return cg::renderer::make_pipeline_state<forward_layout>(instance_vertex_shader, forward_pixel_shader);
+			});
+		}
+		else {
+			for_each_visible_shape([&](size_t shape_id, const auto& lod) {
+				if (gbuffer) {
+					auto pipeline = cg::renderer::make_pipeline_state<gbuffer_layout>(
+						vertex_shader, make_gbuffer_pixel_shader(shape_id));
+					rasterizer->draw_meshlets(pipeline, lod.meshlets, *lod.meshlet_vertices, matrix);
+				}
+				else if (visibility_buffer) {
+					auto pipeline = cg::renderer::make_pipeline_state<cg::attribute_layout<>>(
+						vertex_shader, make_visibility_pixel_shader(shape_id));
+					rasterizer->draw_meshlets(pipeline, lod.meshlets, *lod.meshlet_vertices, matrix);
+				}
+				else {
+					rasterizer->draw_meshlets(forward_pipeline, lod.meshlets, *lod.meshlet_vertices, matrix);
+				}
+			});
+		}
+	}
+	rasterizer->set_depth_func(cg::renderer::depth_func::less);
+
+	rasterizer->resolve_samples();
+
+	if (visibility_buffer) {
+		rasterizer->resolve_visibility(
+			forward_pipeline, model->get_vertex_buffers(), lod_index_buffers);
+	}
+
+	if (gbuffer) {
+		float4x4 inverted_matrix = inverse(matrix);
+		rasterizer->shade_gbuffer([&](const cg::renderer::gbuffer_sample& sample, float depth, size_t x, size_t y) {
+			float4 ndc{
+				2.f * x / settings->width - 1.f,
+				1.f - 2.f * y / settings->height,
+				depth,
+				1.f
+			};
+			float4 position = mul(inverted_matrix, ndc);
+			return shade(
+				float3{ position.x, position.y, position.z } / position.w,
+				sample.normal,
+				shape_ambient[sample.material_id],
+				sample.albedo
+			);
+		});
+	}
+
+	size_t num_shapes = model->get_index_buffers().size();
+	if (instance_buffer) {
+		size_t num_instances = num_shapes * instance_transforms.size();
+		std::cout << "Shape instances: " << num_instances
+				  << ", culled: " << instances_culled
+				  << ", drawn: " << num_instances - instances_culled
+				  << ", instanced draws: " << instanced_draws << std::endl;
+	}
+	else {
+		std::cout << "Shapes: " << num_shapes
+				  << ", frustum culled: " << num_shapes - shapes_in_frustum.size();
+		// Recorded draws are occlusion culled per meshlet only, at replay
+		if (settings->record_threads == 0) {
+			std::cout << ", occlusion culled: " << shapes_occlusion_culled;
+		}
+		std::cout << ", drawn: " << shapes_in_frustum.size() - shapes_occlusion_culled
+				  << ", at reduced detail: " << shapes_simplified << std::endl;
+	}
+
+	const auto& statistics = rasterizer->get_statistics();
+	std::cout << "Meshlets submitted: " << statistics.meshlets_submitted
+			  << ", frustum culled: " << statistics.meshlets_frustum_culled
+			  << ", cone culled: " << statistics.meshlets_cone_culled
+			  << ", occlusion culled: " << statistics.meshlets_occlusion_culled << std::endl;
+	std::cout << "Triangles submitted: " << statistics.triangles_submitted
+			  << ", frustum culled: " << statistics.triangles_frustum_culled
+			  << ", face culled: " << statistics.triangles_face_culled
+			  << ", degenerate culled: " << statistics.triangles_degenerate_culled
+			  << ", occlusion culled: " << statistics.triangles_occlusion_culled
+			  << ", rasterized: " << statistics.triangles_rasterized << std::endl;
+	std::cout << "Fragments shaded: " << statistics.fragments_shaded;
+	if (gbuffer || visibility_buffer) {
+		std::cout << ", pixels lit: " << statistics.pixels_lit
+				  << ", lighting invocations saved: " << statistics.fragments_shaded - statistics.pixels_lit;
+	}
+	std::cout << std::endl;
+	if (settings->record_threads > 0) {
+		std::cout << "Command lists: " << settings->record_threads
+				  << ", draws recorded: " << draws_recorded
+				  << ", batches submitted: " << batches_submitted << std::endl;
+	}
+	if (shadow_rasterizer) {
+		std::cout << "Shadow map views: " << shadow_maps.size() * 6 + directional_shadow_maps.size() * settings->shadow_cascades
+				  << ", triangles rasterized: " << shadow_triangles << std::endl;
+	}
+	if (settings->msaa > 1) {
+		std::cout << "Samples per pixel: " << settings->msaa
+				  << ", pixels resolved from a single color: " << statistics.pixels_compressed << std::endl;
+	}
+
+	rasterizer->flush();
+	std::chrono::duration<float, std::milli> raster_duration = std::chrono::high_resolution_clock::now() - start;
+	std::cout << "Depth format: " << settings->depth_format
+			  << ", tiles accepted without depth reads: " << statistics.depth_tiles_accepted
+			  << ", rasterization took " << raster_duration.count() << " ms" << std::endl;
 
 	cg::utils::save_resource(*render_target, settings->result_path);
 }
\ No newline at end of file
@@ -1,4 +1,7 @@
+#include "renderer/rasterizer/command_list.h"
 #include "renderer/rasterizer/rasterizer.h"
+#include "renderer/rasterizer/shadow_map.h"
+#include "renderer/raytracer/irradiance_cache.h"
 #include "renderer/renderer.h"
 #include "resource.h"
 
@@ -17,7 +20,24 @@ namespace cg::renderer
 	protected:
 		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
 		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::renderer::gbuffer> gbuffer;
+		std::shared_ptr<cg::resource<unsigned int>> visibility_buffer;
 
 		std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>> rasterizer;
+
+		std::vector<cg::renderer::light> lights;
+		std::vector<cg::renderer::directional_light> directional_lights;
+
+		// Depth-only rasterizer of the shadow map views, one map per light
+		std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>> shadow_rasterizer;
+		std::vector<cg::renderer::shadow_map> shadow_maps;
+		std::vector<cg::renderer::shadow_map> directional_shadow_maps;
+		cg::world::bounding_box scene_bounds;
+
+		// Copies of the model on a grid, one instanced draw per shape and LOD
+		std::vector<float4x4> instance_transforms;
+		std::shared_ptr<cg::resource<float4x4>> instance_buffer;
+		// Materials are per shape, the G-buffer material id is the shape id
+		std::vector<float3> shape_ambient;
 	};
 }// namespace cg::renderer
\ No newline at end of file
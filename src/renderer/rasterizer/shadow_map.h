@@ -0,0 +1,267 @@
+#pragma once
+
+#include "resource.h"
+#include "world/bounds.h"
+#include "world/camera.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <linalg.h>
+#include <memory>
+#include <vector>
+
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+    // Depth maps of one light rendered by the rasterizer's depth-only path.
+    // A point light gets six 90 degree views (a cube), a directional light one
+    // orthographic view per cascade, each covering a slice of the camera frustum
+    class shadow_map
+    {
+    public:
+        struct view
+        {
+            float4x4 matrix;
+            std::shared_ptr<cg::resource<float>> depth;
+            // World size of a texel at unit distance (perspective) or everywhere (orthographic)
+            float texel_size;
+            // Camera view depth covered by a cascade
+            float max_distance;
+        };
+
+        shadow_map(size_t in_size);
+
+        void set_point_light(float3 position, float z_near, float z_far);
+        void set_directional_light(
+                float3 direction, const cg::world::camera& camera,
+                const cg::world::bounding_box& scene_bounds, size_t num_cascades);
+
+        size_t get_size() const;
+        const std::vector<view>& get_views() const;
+
+        // Fraction of a 3x3 PCF kernel that sees the light from a world space point
+        float visibility(const float3& position, const float3& normal) const;
+
+    protected:
+        size_t size;
+        std::vector<view> views;
+
+        bool directional = false;
+        float3 light_position;
+        float3 camera_position;
+        float3 camera_direction;
+
+        // Texels of normal offset and depth bias against self-shadowing
+        static constexpr float normal_bias = 1.5f;
+        static constexpr float depth_bias = 1e-5f;
+        // Mix of logarithmic and uniform cascade splits
+        static constexpr float split_lambda = 0.75f;
+
+        void resize_views(size_t num_views);
+        static float4x4 look_to(const float3& position, const float3& direction, const float3& up);
+    };
+
+    inline shadow_map::shadow_map(size_t in_size) : size(in_size) {}
+
+    inline size_t shadow_map::get_size() const
+    {
+        return size;
+    }
+
+    inline const std::vector<shadow_map::view>& shadow_map::get_views() const
+    {
+        return views;
+    }
+
+    inline void shadow_map::resize_views(size_t num_views)
+    {
+        views.resize(num_views);
+        for (auto& view : views) {
+            if (!view.depth) {
+                view.depth = std::make_shared<cg::resource<float>>(size, size);
+            }
+        }
+    }
+
+    // Same convention as camera::get_view_matrix: right-handed, looking down -z
+    inline float4x4 shadow_map::look_to(const float3& position, const float3& direction, const float3& up)
+    {
+        float3 z_axis = normalize(-direction);
+        float3 x_axis = normalize(cross(up, z_axis));
+        float3 y_axis = cross(z_axis, x_axis);
+        return float4x4{
+            { x_axis.x, y_axis.x, z_axis.x, 0 },
+            { x_axis.y, y_axis.y, z_axis.y, 0 },
+            { x_axis.z, y_axis.z, z_axis.z, 0 },
+            { -dot(x_axis, position), -dot(y_axis, position), -dot(z_axis, position), 1 }
+        };
+    }
+
+    inline void shadow_map::set_point_light(float3 position, float z_near, float z_far)
+    {
+        // Cube faces in +x, -x, +y, -y, +z, -z order, see visibility()
+        static const float3 directions[] = {
+            { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 }
+        };
+        static const float3 ups[] = {
+            { 0, 1, 0 }, { 0, 1, 0 }, { 0, 0, 1 }, { 0, 0, 1 }, { 0, 1, 0 }, { 0, 1, 0 }
+        };
+
+        directional = false;
+        light_position = position;
+        resize_views(6);
+
+        // 90 degree field of view, depth from 0 at z_near to 1 at z_far
+        float4x4 projection{
+            { 1, 0, 0, 0 },
+            { 0, 1, 0, 0 },
+            { 0, 0, z_far / (z_near - z_far), -1 },
+            { 0, 0, (z_far * z_near) / (z_near - z_far), 0 }
+        };
+        for (size_t face = 0; face < 6; ++face) {
+            views[face].matrix = mul(projection, look_to(position, directions[face], ups[face]));
+            views[face].texel_size = 2.f / size;
+            views[face].max_distance = FLT_MAX;
+        }
+    }
+
+    inline void shadow_map::set_directional_light(
+            float3 direction, const cg::world::camera& camera,
+            const cg::world::bounding_box& scene_bounds, size_t num_cascades)
+    {
+        directional = true;
+        direction = normalize(direction);
+        camera_position = camera.get_position();
+        camera_direction = normalize(camera.get_direction());
+        resize_views(num_cascades);
+
+        float3 right = normalize(camera.get_right());
+        float3 up = normalize(cross(right, camera_direction));
+        float tan_half_height = std::tan(camera.get_angle_of_view() / 2.f);
+        float tan_half_width = tan_half_height * camera.get_aspect_ratio();
+        float3 light_up = std::abs(direction.y) > 0.99f ? float3{ 0, 0, 1 } : float3{ 0, 1, 0 };
+
+        float z_near = camera.get_z_near();
+        float z_far = camera.get_z_far();
+        float slice_near = z_near;
+        for (size_t cascade = 0; cascade < num_cascades; ++cascade) {
+            float fraction = static_cast<float>(cascade + 1) / num_cascades;
+            float slice_far =
+                split_lambda * z_near * std::pow(z_far / z_near, fraction) +
+                (1.f - split_lambda) * (z_near + (z_far - z_near) * fraction);
+
+            // Bounding sphere of the slice, so the cascade does not change size as the camera turns
+            float3 center = camera_position + camera_direction * ((slice_near + slice_far) / 2.f);
+            float radius = 0.f;
+            for (float distance : { slice_near, slice_far }) {
+                for (float sx : { -1.f, 1.f }) {
+                    for (float sy : { -1.f, 1.f }) {
+                        float3 corner = camera_position + distance * (
+                            camera_direction +
+                            sx * tan_half_width * right +
+                            sy * tan_half_height * up);
+                        radius = std::max(radius, length(corner - center));
+                    }
+                }
+            }
+
+            // Texel-aligned center against shimmering as the camera moves
+            float texel_size = 2.f * radius / size;
+            float4x4 light_view = look_to(float3{ 0, 0, 0 }, direction, light_up);
+            float4 light_center = mul(light_view, float4{ center, 1 });
+            light_center.x = std::floor(light_center.x / texel_size) * texel_size;
+            light_center.y = std::floor(light_center.y / texel_size) * texel_size;
+
+            // Depth range spans the whole scene so casters outside the slice still cast
+            float depth_min = FLT_MAX;
+            float depth_max = -FLT_MAX;
+            for (size_t corner_id = 0; corner_id < 8; ++corner_id) {
+                float3 corner{
+                    (corner_id & 1) ? scene_bounds.max.x : scene_bounds.min.x,
+                    (corner_id & 2) ? scene_bounds.max.y : scene_bounds.min.y,
+                    (corner_id & 4) ? scene_bounds.max.z : scene_bounds.min.z
+                };
+                float depth = dot(corner, direction);
+                depth_min = std::min(depth_min, depth);
+                depth_max = std::max(depth_max, depth);
+            }
+            depth_max = std::max(depth_max, depth_min + 1e-3f);
+
+            // Orthographic: light view x, y over the sphere, depth along the light from 0 to 1
+            float4x4 projection{
+                { 1.f / radius, 0, 0, 0 },
+                { 0, 1.f / radius, 0, 0 },
+                { 0, 0, -1.f / (depth_max - depth_min), 0 },
+                { -light_center.x / radius, -light_center.y / radius, -depth_min / (depth_max - depth_min), 1 }
+            };
+            views[cascade].matrix = mul(projection, light_view);
+            views[cascade].texel_size = texel_size;
+            views[cascade].max_distance = slice_far;
+            slice_near = slice_far;
+        }
+    }
+
+    inline float shadow_map::visibility(const float3& position, const float3& normal) const
+    {
+        if (views.empty()) {
+            return 1.f;
+        }
+
+        size_t view_id = 0;
+        float texel_size = 0.f;
+        if (directional) {
+            float distance = dot(position - camera_position, camera_direction);
+            while (view_id < views.size() && views[view_id].max_distance < distance) {
+                ++view_id;
+            }
+            if (view_id == views.size()) {
+                return 1.f;
+            }
+            texel_size = views[view_id].texel_size;
+        }
+        else {
+            // Cube face of the major axis
+            float3 to_position = position - light_position;
+            float3 magnitude = abs(to_position);
+            if (magnitude.x >= magnitude.y && magnitude.x >= magnitude.z) {
+                view_id = to_position.x > 0 ? 0 : 1;
+            }
+            else if (magnitude.y >= magnitude.z) {
+                view_id = to_position.y > 0 ? 2 : 3;
+            }
+            else {
+                view_id = to_position.z > 0 ? 4 : 5;
+            }
+            texel_size = views[view_id].texel_size * maxelem(magnitude);
+        }
+
+        const auto& view = views[view_id];
+        float4 projected = mul(view.matrix, float4{ position + normal * (normal_bias * texel_size), 1 });
+        if (projected.w <= 0.f) {
+            return 1.f;
+        }
+        float3 ndc = float3{ projected.x, projected.y, projected.z } / projected.w;
+        float x = (ndc.x + 1) * size / 2.f;
+        float y = (-ndc.y + 1) * size / 2.f;
+        float z = ndc.z - depth_bias;
+
+        // Texels are sampled at integer coordinates, as in the rasterizer
+        int center_x = static_cast<int>(std::round(x));
+        int center_y = static_cast<int>(std::round(y));
+        int max_texel = static_cast<int>(size) - 1;
+        float lit = 0.f;
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                size_t texel_x = static_cast<size_t>(std::clamp(center_x + dx, 0, max_texel));
+                size_t texel_y = static_cast<size_t>(std::clamp(center_y + dy, 0, max_texel));
+                if (z <= view.depth->item(texel_x, texel_y)) {
+                    lit += 1.f;
+                }
+            }
+        }
+        return lit / 9.f;
+    }
+}// namespace cg::renderer
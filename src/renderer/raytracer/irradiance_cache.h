@@ -0,0 +1,108 @@
+#pragma once
+
+#include "resource.h"
+#include "utils/error_handler.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <linalg.h>
+#include <memory>
+#include <vector>
+
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+    // Irradiance baked by the raytracer for every vertex of every shape, in the
+    // order of the model's vertex buffers. Stored as the light a white diffuse
+    // surface would reflect, so a vertex's outgoing light is its diffuse times the value
+    class irradiance_cache
+    {
+    public:
+        void resize(const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>& vertex_buffers);
+
+        float3& item(size_t shape_id, size_t vertex_id);
+        const float3& item(size_t shape_id, size_t vertex_id) const;
+
+        void save(const std::filesystem::path& path) const;
+        // Throws when the file was baked for different vertex buffers
+        void load(const std::filesystem::path& path,
+                  const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>& vertex_buffers);
+
+    protected:
+        std::vector<std::vector<float3>> irradiance;
+
+        static constexpr uint32_t magic = 0x52494743;// "CGIR"
+        static constexpr uint32_t version = 1;
+    };
+
+    inline void irradiance_cache::resize(const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>& vertex_buffers)
+    {
+        irradiance.clear();
+        for (const auto& vertex_buffer : vertex_buffers) {
+            irradiance.emplace_back(vertex_buffer->get_number_of_elements(), float3{ 0, 0, 0 });
+        }
+    }
+
+    inline float3& irradiance_cache::item(size_t shape_id, size_t vertex_id)
+    {
+        return irradiance[shape_id][vertex_id];
+    }
+
+    inline const float3& irradiance_cache::item(size_t shape_id, size_t vertex_id) const
+    {
+        return irradiance[shape_id][vertex_id];
+    }
+
+    // Magic, version and shape count, then the vertex count and values of every shape
+    inline void irradiance_cache::save(const std::filesystem::path& path) const
+    {
+        std::ofstream file(path, std::ios::binary);
+        if (!file) {
+            THROW_ERROR("Can not write irradiance cache " + path.string());
+        }
+        uint32_t header[] = { magic, version, static_cast<uint32_t>(irradiance.size()) };
+        file.write(reinterpret_cast<const char*>(header), sizeof(header));
+        for (const auto& shape : irradiance) {
+            uint32_t count = static_cast<uint32_t>(shape.size());
+            file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+            file.write(reinterpret_cast<const char*>(shape.data()), shape.size() * sizeof(float3));
+        }
+        if (!file) {
+            THROW_ERROR("Can not write irradiance cache " + path.string());
+        }
+    }
+
+    inline void irradiance_cache::load(
+            const std::filesystem::path& path,
+            const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>& vertex_buffers)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            THROW_ERROR("Can not read irradiance cache " + path.string());
+        }
+        uint32_t header[3] = {};
+        file.read(reinterpret_cast<char*>(header), sizeof(header));
+        if (!file || header[0] != magic || header[1] != version) {
+            THROW_ERROR("Not an irradiance cache: " + path.string());
+        }
+        if (header[2] != vertex_buffers.size()) {
+            THROW_ERROR("Irradiance cache was baked for another model: " + path.string());
+        }
+
+        resize(vertex_buffers);
+        for (auto& shape : irradiance) {
+            uint32_t count = 0;
+            file.read(reinterpret_cast<char*>(&count), sizeof(count));
+            if (!file || count != shape.size()) {
+                THROW_ERROR("Irradiance cache was baked for another model: " + path.string());
+            }
+            file.read(reinterpret_cast<char*>(shape.data()), shape.size() * sizeof(float3));
+        }
+        if (!file) {
+            THROW_ERROR("Irradiance cache is truncated: " + path.string());
+        }
+    }
+}// namespace cg::renderer
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "utils/error_handler.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <linalg.h>
+#include <vector>
+
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+    // Sums of progressive rendering after a number of whole frames, and the camera,
+    // viewport, depth and ambient occlusion they were traced with, so a resumed render
+    // can not mix images
+    struct progressive_checkpoint
+    {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint64_t frames = 0;
+        uint64_t depth = 0;
+        // 0 samples for a lit render
+        uint32_t ao_samples = 0;
+        float ao_distance = 0.f;
+        float3 position{};
+        float3 direction{};
+        float3 right{};
+        float3 up{};
+        std::vector<float3> sum;
+        std::vector<float> luminance_square;
+
+        // Written beside path and renamed over it: a crash while writing keeps the
+        // previous checkpoint whole
+        void save(const std::filesystem::path& path) const;
+        // Throws on a file that is not a complete checkpoint
+        void load(const std::filesystem::path& path);
+
+        static constexpr uint32_t magic = 0x43504743;// "CGPC"
+        static constexpr uint32_t version = 2;
+    };
+
+    // Magic and version, the fields in order, then both buffers row by row
+    inline void progressive_checkpoint::save(const std::filesystem::path& path) const
+    {
+        std::filesystem::path partial_path = path;
+        partial_path += ".partial";
+        {
+            std::ofstream file(partial_path, std::ios::binary);
+            if (!file) {
+                THROW_ERROR("Can not write checkpoint " + partial_path.string());
+            }
+            uint32_t header[] = { magic, version, width, height };
+            file.write(reinterpret_cast<const char*>(header), sizeof(header));
+            file.write(reinterpret_cast<const char*>(&frames), sizeof(frames));
+            file.write(reinterpret_cast<const char*>(&depth), sizeof(depth));
+            file.write(reinterpret_cast<const char*>(&ao_samples), sizeof(ao_samples));
+            file.write(reinterpret_cast<const char*>(&ao_distance), sizeof(ao_distance));
+            float3 camera[] = { position, direction, right, up };
+            file.write(reinterpret_cast<const char*>(camera), sizeof(camera));
+            file.write(reinterpret_cast<const char*>(sum.data()), sum.size() * sizeof(float3));
+            file.write(reinterpret_cast<const char*>(luminance_square.data()), luminance_square.size() * sizeof(float));
+            file.flush();
+            if (!file) {
+                THROW_ERROR("Can not write checkpoint " + partial_path.string());
+            }
+        }
+        std::filesystem::rename(partial_path, path);
+    }
+
+    inline void progressive_checkpoint::load(const std::filesystem::path& path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            THROW_ERROR("Can not read checkpoint " + path.string());
+        }
+        uint32_t header[4] = {};
+        file.read(reinterpret_cast<char*>(header), sizeof(header));
+        if (!file || header[0] != magic || header[1] != version) {
+            THROW_ERROR("Not a checkpoint: " + path.string());
+        }
+        width = header[2];
+        height = header[3];
+        file.read(reinterpret_cast<char*>(&frames), sizeof(frames));
+        file.read(reinterpret_cast<char*>(&depth), sizeof(depth));
+        file.read(reinterpret_cast<char*>(&ao_samples), sizeof(ao_samples));
+        file.read(reinterpret_cast<char*>(&ao_distance), sizeof(ao_distance));
+        float3 camera[4] = {};
+        file.read(reinterpret_cast<char*>(camera), sizeof(camera));
+        position = camera[0];
+        direction = camera[1];
+        right = camera[2];
+        up = camera[3];
+
+        size_t pixels = static_cast<size_t>(width) * height;
+        sum.resize(pixels);
+        luminance_square.resize(pixels);
+        file.read(reinterpret_cast<char*>(sum.data()), pixels * sizeof(float3));
+        file.read(reinterpret_cast<char*>(luminance_square.data()), pixels * sizeof(float));
+        if (!file) {
+            THROW_ERROR("Checkpoint is truncated: " + path.string());
+        }
+    }
+}// namespace cg::renderer
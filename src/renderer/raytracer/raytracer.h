@@ -1,7 +1,17 @@
 #pragma once
 
+#include "renderer/raytracer/progressive_checkpoint.h"
 #include "resource.h"
+#include "utils/error_handler.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <linalg.h>
 #include <memory>
@@ -20,6 +30,16 @@ namespace cg::renderer
         }
         float3 position;
         float3 direction;
+
+        // Ray cone: width at the origin and its growth per unit of distance.
+        // Rays with no footprint always hit full detail geometry
+        float footprint = 0.f;
+        float spread = 0.f;
+
+        float footprint_at(float t) const
+        {
+            return footprint + spread * t;
+        }
     };
 
     struct payload
@@ -77,6 +97,9 @@ namespace cg::renderer
         void add_triangle(const triangle<VB> triangle);
         const std::vector<triangle<VB>>& get_triangles() const;
         bool aabb_test(const ray& ray) const;
+        // Only boxes the ray enters before max_t
+        bool aabb_test(const ray& ray, float max_t) const;
+        float distance(const float3& point) const;
 
     protected:
         std::vector<triangle<VB>> triangles;
@@ -85,10 +108,67 @@ namespace cg::renderer
         float3 aabb_max;
     };
 
-    struct light
+    // Direction around normal with a cosine-weighted density, so averaging the
+    // radiance of such rays gives irradiance without a cosine factor
+    template<typename Generator>
+    inline float3 cosine_sample_hemisphere(const float3& normal, Generator& generator)
     {
-        float3 position;
-        float3 color;
+        std::uniform_real_distribution<float> uniform(0.f, 1.f);
+        float radius = std::sqrt(uniform(generator));
+        float angle = 2.f * 3.14159265f * uniform(generator);
+        float3 tangent = normalize(cross(std::abs(normal.x) > 0.9f ? float3{ 0, 1, 0 } : float3{ 1, 0, 0 }, normal));
+        float3 bitangent = cross(normal, tangent);
+        return normalize(
+            tangent * (radius * std::cos(angle)) +
+            bitangent * (radius * std::sin(angle)) +
+            normal * std::sqrt(std::max(0.f, 1.f - radius * radius)));
+    }
+
+    enum class progressive_stop
+    {
+        max_frames,
+        deadline,
+        noise,
+        cancelled
+    };
+
+    // Limits of progressive_generation, zero disables a limit
+    template<typename RT>
+    struct progressive_settings
+    {
+        std::chrono::duration<float, std::milli> time_budget{ 0.f };
+        // Mean standard error of the pixel luminance, in linear color
+        float target_noise = 0.f;
+        size_t max_frames = 1024;
+        // Shows the mean itself instead of sqrt of it, for payloads that already are
+        // display values such as ambient occlusion
+        bool linear_output = false;
+        // Period of on_image. It gets its own copy of the image on its own thread, an
+        // image due while the previous one is still being handled is skipped
+        std::chrono::duration<float, std::milli> image_interval{ 0.f };
+        std::function<void(resource<RT>& image, size_t frames)> on_image = nullptr;
+
+        // Set from any thread to stop: the frame being traced is dropped, as at the deadline
+        const std::atomic<bool>* cancel = nullptr;
+        // Saved every checkpoint_interval and when rendering stops, empty for none
+        std::filesystem::path checkpoint_path;
+        std::chrono::duration<float, std::milli> checkpoint_interval{ 60000.f };
+        // Continues from checkpoint_path when the file exists
+        bool resume = false;
+        // Ambient occlusion the shaders trace, 0 samples when they light the scene. Kept
+        // in the checkpoint, a resumed render can not mix the two
+        uint32_t ao_samples = 0;
+        float ao_distance = 0.f;
+    };
+
+    struct progressive_result
+    {
+        size_t frames = 0;
+        // Of frames, the ones loaded from the checkpoint
+        size_t resumed_frames = 0;
+        size_t passes = 0;
+        float noise = 0.f;
+        progressive_stop stopped_by = progressive_stop::max_frames;
     };
 
     template<typename VB, typename RT>
@@ -99,18 +179,61 @@ namespace cg::renderer
         ~raytracer(){};
 
         void set_render_target(std::shared_ptr<resource<RT>> in_render_target);
+        // Only flags every tile as cleared, ray_generation overwrites the flagged
+        // tiles instead of accumulating into them, see flush
         void clear_render_target(const RT& in_clear_value);
+        // Fills the tiles still flagged as cleared, in parallel
+        void flush();
         void set_viewport(size_t in_width, size_t in_height);
 
         void set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers);
         void set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers);
+        // Chains with .index_buffer and .error per level, level 0 being the full detail
+        // index buffer already set with set_index_buffers
+        template<typename LodChains>
+        void set_lods(const LodChains& in_lods);
+        // Largest LOD error allowed, in ray footprints, 0 keeps full detail
+        void set_lod_threshold(float in_lod_threshold);
+        // Rebuilds from the current buffers, invalidating the primary hit cache
         void build_acceleration_structure();
         std::vector<aabb<VB>> acceleration_structures;
+        // Coarser levels per shape, acceleration_structures being level 0
+        std::vector<std::vector<aabb<VB>>> lod_acceleration_structures;
+        std::vector<std::vector<float>> lod_errors;
 
         void ray_generation(float3 position, float3 direction, float3 right, float3 up, size_t depth, size_t accumulation_num);
+        // Jittered frames in passes of 1, 2, 4... frames, averaged in linear color and
+        // shown as sqrt of the mean, unless linear_output: one frame looks like
+        // ray_generation with one frame.
+        // The deadline is checked per row, a frame it cuts short is dropped, so the
+        // image only holds whole frames; the first frame always completes. Noise is
+        // checked after every pass. Uses neither the primary hit cache nor reprojection.
+        // A resumed render continues the jitter sequence where the checkpoint stopped
+        progressive_result progressive_generation(
+                float3 position, float3 direction, float3 right, float3 up, size_t depth,
+                const progressive_settings<RT>& progress);
+
+        // Keeps the primary hit of every pixel and frame of ray_generation. A later call
+        // with the same camera, viewport and acceleration structures only re-runs the
+        // shaders on the kept hits, so changing lights or shaders needs no primary traversal
+        void set_primary_hit_cache(bool in_enabled);
+        size_t get_primary_hits_reused() const;
+
+        // Blends the history of ray_generation with the previous call's, reprojected
+        // through the primary hit depth into the previous camera. Pixels whose depth does
+        // not match there were disoccluded and start over; the others weigh the new
+        // samples by 1 / length of their history, up to max_history
+        void set_temporal_reprojection(bool in_enabled, float in_max_history = 16.f);
+        size_t get_pixels_reprojected() const;
 
         payload trace_ray(const ray& ray, size_t depth, float max_t = 1000.f, float min_t = 0.001f) const;
+        // Traversal part of trace_ray: the closest hit, or the first one with an any hit
+        // shader, and its triangle, nullptr on a miss
+        payload find_hit(const ray& ray, float max_t, float min_t, const triangle<VB>*& hit_triangle) const;
         payload intersection_shader(const triangle<VB>& triangle, const ray& ray) const;
+        // Occlusion-only traversal: stops at the first triangle between min_t and max_t
+        // and runs no shaders
+        bool trace_occlusion(const ray& ray, float max_t, float min_t = 0.001f) const;
 
         std::function<payload(const ray& ray)> miss_shader = nullptr;
         std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle, size_t depth)>
@@ -121,8 +244,95 @@ namespace cg::renderer
         float2 get_jitter(int frame_id);
 
     protected:
+        size_t select_lod(size_t shape_id, const ray& ray) const;
+        // Shaders of trace_ray for a hit found by find_hit
+        payload shade_hit(const ray& ray, payload& hit, const triangle<VB>* hit_triangle, size_t depth) const;
+
+        // Payload color is left out, shaders write it
+        struct primary_hit
+        {
+            float t;
+            float3 bary;
+            const triangle<VB>* hit_triangle;
+        };
+        // What the kept hits were traced for
+        struct primary_hit_key
+        {
+            float3 position;
+            float3 direction;
+            float3 right;
+            float3 up;
+            size_t accumulation_num;
+            size_t width;
+            size_t height;
+            size_t geometry_version;
+
+            bool operator==(const primary_hit_key& other) const
+            {
+                return position == other.position && direction == other.direction &&
+                       right == other.right && up == other.up &&
+                       accumulation_num == other.accumulation_num &&
+                       width == other.width && height == other.height &&
+                       geometry_version == other.geometry_version;
+            }
+        };
+        struct camera_frame
+        {
+            float3 position;
+            float3 direction;
+            float3 right;
+            float3 up;
+        };
+        float3 pixel_direction(const camera_frame& camera, float2 pixel) const;
+        void reproject_history(const camera_frame& camera);
+
+        bool temporal_reprojection = false;
+        float max_history = 16.f;
+        // Relative difference of distances above which a reprojected pixel is disoccluded
+        static constexpr float disocclusion_tolerance = 0.02f;
+        // Distance to the primary hit of the first frame, FLT_MAX on a miss
+        std::shared_ptr<cg::resource<float>> primary_depth;
+        std::shared_ptr<cg::resource<float>> history_length;
+        std::shared_ptr<cg::resource<float3>> previous_history;
+        std::shared_ptr<cg::resource<float>> previous_depth;
+        std::shared_ptr<cg::resource<float>> previous_history_length;
+        camera_frame previous_camera{};
+        bool previous_valid = false;
+        size_t pixels_reprojected = 0;
+
+        bool primary_hit_cache = false;
+        std::vector<primary_hit> primary_hits;
+        primary_hit_key primary_hits_key{};
+        bool primary_hits_valid = false;
+        size_t primary_hits_reused = 0;
+        // Bumped on every build, triangle pointers of older builds dangle
+        size_t geometry_version = 0;
+
+        std::vector<std::vector<std::shared_ptr<cg::resource<unsigned int>>>> lod_index_buffers;
+        float lod_threshold = 1.f;
+
         std::shared_ptr<cg::resource<RT>> render_target;
         std::shared_ptr<cg::resource<float3>> history;
+
+        // Sums of progressive_generation over its frames, and the frame being traced
+        void resolve_progressive();
+        float progressive_noise() const;
+        // Throws when the checkpoint was traced with another camera, viewport, depth or
+        // ambient occlusion
+        void load_progressive_checkpoint(
+                const progressive_settings<RT>& progress, const camera_frame& camera, size_t depth);
+        void save_progressive_checkpoint(
+                const progressive_settings<RT>& progress, const camera_frame& camera, size_t depth) const;
+        std::shared_ptr<cg::resource<float3>> progressive_sum;
+        std::shared_ptr<cg::resource<float>> progressive_luminance_square;
+        std::shared_ptr<cg::resource<float3>> progressive_frame;
+        size_t progressive_frames = 0;
+        bool progressive_linear_output = false;
+
+        // Fast clear, as in the rasterizer: one flag per tile_size x tile_size pixels
+        static constexpr size_t tile_size = 8;
+        std::vector<uint8_t> cleared_tiles;
+        RT clear_value{};
         std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
         std::vector<std::shared_ptr<cg::resource<VB>>> vertex_buffers;
 
@@ -140,10 +350,29 @@ namespace cg::renderer
     template<typename VB, typename RT>
     inline void raytracer<VB, RT>::clear_render_target(const RT& in_clear_value)
     {
-        for (size_t i = 0; i < width * height; ++i) {
-            render_target->item(i) = in_clear_value;
-            if (history) {
-                history->item(i) = float3{ 0.0f, 0.0f, 0.0f }; // AMGOUS.
+        clear_value = in_clear_value;
+        cleared_tiles.assign(((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size), 1);
+    }
+
+    template<typename VB, typename RT>
+    inline void raytracer<VB, RT>::flush()
+    {
+        size_t tiles_x = (width + tile_size - 1) / tile_size;
+#pragma omp parallel for schedule(dynamic)
+        for (int tile = 0; tile < static_cast<int>(cleared_tiles.size()); ++tile) {
+            if (!cleared_tiles[tile]) {
+                continue;
+            }
+            cleared_tiles[tile] = 0;
+
+            size_t begin_x = (tile % tiles_x) * tile_size;
+            size_t begin_y = (tile / tiles_x) * tile_size;
+            size_t row_size = std::min(width, begin_x + tile_size) - begin_x;
+            for (size_t y = begin_y; y < std::min(height, begin_y + tile_size); ++y) {
+                std::fill_n(&render_target->item(begin_x, y), row_size, clear_value);
+                if (history) {
+                    std::fill_n(&history->item(begin_x, y), row_size, float3{ 0.0f, 0.0f, 0.0f });
+                }
             }
         }
     }
@@ -159,12 +388,32 @@ namespace cg::renderer
     }
 
     template<typename VB, typename RT>
-    inline void raytracer<VB, RT>::build_acceleration_structure()
+    template<typename LodChains>
+    inline void raytracer<VB, RT>::set_lods(const LodChains& in_lods)
     {
-        for (size_t shape_id = 0; shape_id < index_buffers.size(); ++shape_id) {
-            auto& index_buffer  = index_buffers[shape_id];
-            auto& vertex_buffer = vertex_buffers[shape_id];
+        lod_index_buffers.clear();
+        lod_errors.clear();
+        for (const auto& chain : in_lods) {
+            lod_index_buffers.emplace_back();
+            lod_errors.emplace_back();
+            for (size_t lod_id = 1; lod_id < chain.size(); ++lod_id) {
+                lod_index_buffers.back().push_back(chain[lod_id].index_buffer);
+                lod_errors.back().push_back(chain[lod_id].error);
+            }
+        }
+    }
+
+    template<typename VB, typename RT>
+    inline void raytracer<VB, RT>::set_lod_threshold(float in_lod_threshold)
+    {
+        lod_threshold = in_lod_threshold;
+    }
 
+    template<typename VB, typename RT>
+    inline void raytracer<VB, RT>::build_acceleration_structure()
+    {
+        auto build_aabb = [](const std::shared_ptr<cg::resource<VB>>& vertex_buffer,
+                const std::shared_ptr<cg::resource<unsigned int>>& index_buffer) {
             size_t index_id = 0;
             aabb<VB> aabb;
             while (index_id < index_buffer->get_number_of_elements()) {
@@ -175,8 +424,46 @@ namespace cg::renderer
                 );
                 aabb.add_triangle(triangle);
             }
-            acceleration_structures.push_back(aabb);
+            return aabb;
+        };
+
+        acceleration_structures.clear();
+        lod_acceleration_structures.clear();
+        ++geometry_version;
+        primary_hits_valid = false;
+        previous_valid = false;
+        for (size_t shape_id = 0; shape_id < index_buffers.size(); ++shape_id) {
+            acceleration_structures.push_back(build_aabb(vertex_buffers[shape_id], index_buffers[shape_id]));
+
+            lod_acceleration_structures.emplace_back();
+            if (shape_id < lod_index_buffers.size()) {
+                for (const auto& index_buffer : lod_index_buffers[shape_id]) {
+                    lod_acceleration_structures.back().push_back(build_aabb(vertex_buffers[shape_id], index_buffer));
+                }
+            }
+        }
+    }
+
+    // Coarsest level whose error stays under the ray footprint where the ray
+    // reaches the shape's bounds
+    // Returns 0 for full detail, otherwise lod_acceleration_structures[shape_id][lod - 1]
+    template<typename VB, typename RT>
+    inline size_t raytracer<VB, RT>::select_lod(size_t shape_id, const ray& ray) const
+    {
+        if (shape_id >= lod_acceleration_structures.size() ||
+            lod_acceleration_structures[shape_id].empty() ||
+            lod_threshold <= 0.f || (ray.footprint <= 0.f && ray.spread <= 0.f)) {
+            return 0;
         }
+
+        float distance = acceleration_structures[shape_id].distance(ray.position);
+        float footprint = ray.footprint_at(distance) * lod_threshold;
+        const auto& errors = lod_errors[shape_id];
+        size_t lod_id = 0;
+        while (lod_id < errors.size() && errors[lod_id] <= footprint) {
+            ++lod_id;
+        }
+        return lod_id;
     }
 
     template<typename VB, typename RT>
@@ -185,6 +472,15 @@ namespace cg::renderer
         width = in_width;
         height = in_height;
         history = std::make_shared<cg::resource<float3>>(width, height);
+        cleared_tiles.clear();
+        if (temporal_reprojection) {
+            primary_depth = std::make_shared<cg::resource<float>>(width, height);
+            history_length = std::make_shared<cg::resource<float>>(width, height);
+            previous_history = std::make_shared<cg::resource<float3>>(width, height);
+            previous_depth = std::make_shared<cg::resource<float>>(width, height);
+            previous_history_length = std::make_shared<cg::resource<float>>(width, height);
+        }
+        previous_valid = false;
     }
 
     template<typename VB, typename RT>
@@ -195,6 +491,15 @@ namespace cg::renderer
     )
     {
         float frame_weight = 1.0f / static_cast<float>(accumulation_num);
+        size_t tiles_x = (width + tile_size - 1) / tile_size;
+
+        primary_hit_key key{ position, direction, right, up, accumulation_num, width, height, geometry_version };
+        bool reuse_hits = primary_hit_cache && primary_hits_valid && primary_hits_key == key;
+        if (primary_hit_cache && !reuse_hits) {
+            primary_hits.resize(width * height * accumulation_num);
+        }
+        primary_hits_reused = 0;
+
         for (size_t frame_id = 0; frame_id < accumulation_num; ++frame_id) {
             float2 jitter = get_jitter(static_cast<int>(frame_id));
             for (int x = 0; x < static_cast<int>(width); ++x) {
@@ -207,9 +512,34 @@ namespace cg::renderer
                     float3 ray_direction = direction + u * right - v * up;
                     ray ray(position, ray_direction);
 
-                    payload payload = trace_ray(ray, depth);
+                    // trace_ray, with the primary hit kept or reused
+                    payload hit{};
+                    const triangle<VB>* hit_triangle = nullptr;
+                    if (depth > 0 && !primary_hit_cache) {
+                        hit = find_hit(ray, 1000.f, 0.001f, hit_triangle);
+                    }
+                    else if (depth > 0) {
+                        auto& cached = primary_hits[(frame_id * height + y) * width + x];
+                        if (!reuse_hits) {
+                            auto traced = find_hit(ray, 1000.f, 0.001f, cached.hit_triangle);
+                            cached.t = traced.t;
+                            cached.bary = traced.bary;
+                        }
+                        hit.t = cached.t;
+                        hit.bary = cached.bary;
+                        hit_triangle = cached.hit_triangle;
+                    }
+                    if (frame_id == 0 && temporal_reprojection) {
+                        primary_depth->item(x, y) = hit_triangle ? hit.t : FLT_MAX;
+                    }
+                    payload payload = depth == 0 ? miss_shader(ray) : shade_hit(ray, hit, hit_triangle, depth - 1);
 
+                    // The first frame covers every pixel, so a cleared tile needs no fill
                     auto& history_pixel = history->item(x, y);
+                    if (frame_id == 0 && !cleared_tiles.empty() &&
+                        cleared_tiles[(y / tile_size) * tiles_x + x / tile_size]) {
+                        history_pixel = float3{ 0.0f, 0.0f, 0.0f };
+                    }
                     history_pixel += sqrt(frame_weight * float3{
                         payload.color.r,
                         payload.color.g,
@@ -219,9 +549,341 @@ namespace cg::renderer
                     render_target->item(x, y) = RT::from_float3(history_pixel);
                 }
             }
+            std::fill(cleared_tiles.begin(), cleared_tiles.end(), 0);
+        }
+
+        if (temporal_reprojection) {
+            reproject_history(camera_frame{ position, direction, right, up });
+        }
+
+        if (primary_hit_cache) {
+            primary_hits_key = key;
+            primary_hits_valid = true;
+            if (reuse_hits) {
+                primary_hits_reused = primary_hits.size();
+            }
         }
     }
 
+    template<typename VB, typename RT>
+    inline progressive_result raytracer<VB, RT>::progressive_generation(
+            float3 position, float3 direction, float3 right, float3 up, size_t depth,
+            const progressive_settings<RT>& progress)
+    {
+        using clock = std::chrono::steady_clock;
+        auto start = clock::now();
+        auto deadline = start + std::chrono::duration_cast<clock::duration>(progress.time_budget);
+        bool has_deadline = progress.time_budget.count() > 0.f;
+
+        progressive_sum = std::make_shared<cg::resource<float3>>(width, height);
+        progressive_luminance_square = std::make_shared<cg::resource<float>>(width, height);
+        progressive_frame = std::make_shared<cg::resource<float3>>(width, height);
+        progressive_frames = 0;
+        progressive_linear_output = progress.linear_output;
+        std::fill(cleared_tiles.begin(), cleared_tiles.end(), 0);
+
+        camera_frame camera{ position, direction, right, up };
+        progressive_result result{};
+        bool checkpoints = !progress.checkpoint_path.empty();
+        if (checkpoints && progress.resume && std::filesystem::exists(progress.checkpoint_path)) {
+            load_progressive_checkpoint(progress, camera, depth);
+            result.resumed_frames = progressive_frames;
+        }
+        auto cancelled = [&progress]() {
+            return progress.cancel && progress.cancel->load(std::memory_order_relaxed);
+        };
+
+        std::future<void> pending_image;
+        auto last_image = start;
+        auto last_checkpoint = start;
+
+        bool stopped = false;
+        for (size_t pass = 0; !stopped; ++pass) {
+            size_t pass_frames = size_t{ 1 } << std::min(pass, size_t{ 16 });
+            for (size_t pass_frame = 0; pass_frame < pass_frames; ++pass_frame) {
+                if (progress.max_frames > 0 && progressive_frames >= progress.max_frames) {
+                    result.stopped_by = progressive_stop::max_frames;
+                    stopped = true;
+                    break;
+                }
+                if (cancelled()) {
+                    result.stopped_by = progressive_stop::cancelled;
+                    stopped = true;
+                    break;
+                }
+
+                float2 jitter = get_jitter(static_cast<int>(progressive_frames)) / 2.0f;
+                bool check_deadline = has_deadline && progressive_frames > 0;
+                std::atomic<bool> interrupted{ false };
+#pragma omp parallel for schedule(dynamic)
+                for (int y = 0; y < static_cast<int>(height); ++y) {
+                    if (interrupted.load(std::memory_order_relaxed)) {
+                        continue;
+                    }
+                    if ((check_deadline && clock::now() >= deadline) || cancelled()) {
+                        interrupted = true;
+                        continue;
+                    }
+                    for (size_t x = 0; x < width; ++x) {
+                        ray ray(position, pixel_direction(
+                            camera, float2{ static_cast<float>(x), static_cast<float>(y) } + jitter));
+                        progressive_frame->item(x, y) = trace_ray(ray, depth).color.to_float3();
+                    }
+                }
+                if (interrupted) {
+                    result.stopped_by = cancelled() ? progressive_stop::cancelled : progressive_stop::deadline;
+                    stopped = true;
+                    break;
+                }
+
+#pragma omp parallel for
+                for (int y = 0; y < static_cast<int>(height); ++y) {
+                    for (size_t x = 0; x < width; ++x) {
+                        float3 color = progressive_frame->item(x, y);
+                        float luminance = dot(color, float3{ 0.2126f, 0.7152f, 0.0722f });
+                        progressive_sum->item(x, y) += color;
+                        progressive_luminance_square->item(x, y) += luminance * luminance;
+                    }
+                }
+                ++progressive_frames;
+
+                auto now = clock::now();
+                if (checkpoints && now - last_checkpoint >= progress.checkpoint_interval) {
+                    save_progressive_checkpoint(progress, camera, depth);
+                    last_checkpoint = now;
+                }
+
+                bool image_due = progress.on_image && progress.image_interval.count() > 0.f &&
+                                 now - last_image >= progress.image_interval;
+                bool writer_idle = !pending_image.valid() ||
+                                   pending_image.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+                if (image_due && writer_idle) {
+                    if (pending_image.valid()) {
+                        pending_image.get();
+                    }
+                    resolve_progressive();
+                    auto image = std::make_shared<cg::resource<RT>>(*render_target);
+                    size_t frames = progressive_frames;
+                    pending_image = std::async(std::launch::async, [image, frames, &progress]() {
+                        progress.on_image(*image, frames);
+                    });
+                    last_image = now;
+                }
+            }
+            if (stopped) {
+                break;
+            }
+            ++result.passes;
+
+            if (progress.target_noise > 0.f && progressive_frames > 1) {
+                result.noise = progressive_noise();
+                if (result.noise <= progress.target_noise) {
+                    result.stopped_by = progressive_stop::noise;
+                    stopped = true;
+                }
+            }
+        }
+
+        resolve_progressive();
+        if (progressive_frames > 1) {
+            result.noise = progressive_noise();
+        }
+        result.frames = progressive_frames;
+        if (checkpoints) {
+            save_progressive_checkpoint(progress, camera, depth);
+        }
+        // Rethrows what on_image threw
+        if (pending_image.valid()) {
+            pending_image.get();
+        }
+        return result;
+    }
+
+    template<typename VB, typename RT>
+    inline void raytracer<VB, RT>::resolve_progressive()
+    {
+        float frame_weight = 1.0f / static_cast<float>(std::max(progressive_frames, size_t{ 1 }));
+#pragma omp parallel for
+        for (int y = 0; y < static_cast<int>(height); ++y) {
+            for (size_t x = 0; x < width; ++x) {
+                float3 mean = progressive_sum->item(x, y) * frame_weight;
+                render_target->item(x, y) = RT::from_float3(progressive_linear_output ? mean : sqrt(mean));
+            }
+        }
+    }
+
+    template<typename VB, typename RT>
+    inline void raytracer<VB, RT>::load_progressive_checkpoint(
+            const progressive_settings<RT>& progress, const camera_frame& camera, size_t depth)
+    {
+        const auto& path = progress.checkpoint_path;
+        progressive_checkpoint checkpoint;
+        checkpoint.load(path);
+        if (checkpoint.width != width || checkpoint.height != height || checkpoint.depth != depth ||
+            !(checkpoint.position == camera.position) || !(checkpoint.direction == camera.direction) ||
+            !(checkpoint.right == camera.right) || !(checkpoint.up == camera.up)) {
+            THROW_ERROR("Checkpoint was rendered with another camera, viewport or depth: " + path.string());
+        }
+        if (checkpoint.ao_samples != progress.ao_samples || checkpoint.ao_distance != progress.ao_distance) {
+            THROW_ERROR("Checkpoint was rendered with another ambient occlusion: " + path.string());
+        }
+        for (size_t i = 0; i < width * height; ++i) {
+            progressive_sum->item(i) = checkpoint.sum[i];
+            progressive_luminance_square->item(i) = checkpoint.luminance_square[i];
+        }
+        progressive_frames = static_cast<size_t>(checkpoint.frames);
+    }
+
+    template<typename VB, typename RT>
+    inline void raytracer<VB, RT>::save_progressive_checkpoint(
+            const progressive_settings<RT>& progress, const camera_frame& camera, size_t depth) const
+    {
+        progressive_checkpoint checkpoint;
+        checkpoint.width = static_cast<uint32_t>(width);
+        checkpoint.height = static_cast<uint32_t>(height);
+        checkpoint.frames = progressive_frames;
+        checkpoint.depth = depth;
+        checkpoint.ao_samples = progress.ao_samples;
+        checkpoint.ao_distance = progress.ao_distance;
+        checkpoint.position = camera.position;
+        checkpoint.direction = camera.direction;
+        checkpoint.right = camera.right;
+        checkpoint.up = camera.up;
+        checkpoint.sum.resize(width * height);
+        checkpoint.luminance_square.resize(width * height);
+        for (size_t i = 0; i < width * height; ++i) {
+            checkpoint.sum[i] = progressive_sum->item(i);
+            checkpoint.luminance_square[i] = progressive_luminance_square->item(i);
+        }
+        checkpoint.save(progress.checkpoint_path);
+    }
+
+    // Mean over the pixels of the standard error of their luminance, needs two frames
+    template<typename VB, typename RT>
+    inline float raytracer<VB, RT>::progressive_noise() const
+    {
+        double frames = static_cast<double>(progressive_frames);
+        double total = 0.0;
+#pragma omp parallel for reduction(+ : total)
+        for (int y = 0; y < static_cast<int>(height); ++y) {
+            for (size_t x = 0; x < width; ++x) {
+                double mean = dot(progressive_sum->item(x, y), float3{ 0.2126f, 0.7152f, 0.0722f }) / frames;
+                double variance = (progressive_luminance_square->item(x, y) / frames - mean * mean) *
+                                  frames / (frames - 1.0);
+                total += std::sqrt(std::max(variance, 0.0) / frames);
+            }
+        }
+        return static_cast<float>(total / static_cast<double>(width * height));
+    }
+
+    template<typename VB, typename RT>
+    inline void raytracer<VB, RT>::set_primary_hit_cache(bool in_enabled)
+    {
+        primary_hit_cache = in_enabled;
+        primary_hits_valid = false;
+        if (!primary_hit_cache) {
+            primary_hits.clear();
+        }
+    }
+
+    template<typename VB, typename RT>
+    inline size_t raytracer<VB, RT>::get_primary_hits_reused() const
+    {
+        return primary_hits_reused;
+    }
+
+    template<typename VB, typename RT>
+    inline void raytracer<VB, RT>::set_temporal_reprojection(bool in_enabled, float in_max_history)
+    {
+        temporal_reprojection = in_enabled;
+        max_history = std::max(in_max_history, 1.f);
+        // Allocates or drops the buffers
+        set_viewport(width, height);
+    }
+
+    template<typename VB, typename RT>
+    inline size_t raytracer<VB, RT>::get_pixels_reprojected() const
+    {
+        return pixels_reprojected;
+    }
+
+    // Unnormalized direction of ray_generation through a pixel, jitter included
+    template<typename VB, typename RT>
+    inline float3 raytracer<VB, RT>::pixel_direction(const camera_frame& camera, float2 pixel) const
+    {
+        float u = 2.0f * pixel.x / static_cast<float>(width  - 1) - 1.0f;
+        float v = 2.0f * pixel.y / static_cast<float>(height - 1) - 1.0f;
+        u *= static_cast<float>(width) / static_cast<float>(height);
+        return camera.direction + u * camera.right - v * camera.up;
+    }
+
+    template<typename VB, typename RT>
+    inline void raytracer<VB, RT>::reproject_history(const camera_frame& camera)
+    {
+        // Depth was taken with the rays of the first frame
+        float2 jitter = get_jitter(0) / 2.0f;
+        float aspect_ratio = static_cast<float>(width) / static_cast<float>(height);
+
+        long long reprojected = 0;
+#pragma omp parallel for reduction(+ : reprojected)
+        for (int y = 0; y < static_cast<int>(height); ++y) {
+            for (size_t x = 0; x < width; ++x) {
+                history_length->item(x, y) = 1.0f;
+                float distance = primary_depth->item(x, y);
+                if (!previous_valid || distance == FLT_MAX) {
+                    continue;
+                }
+                float3 point = camera.position + distance * normalize(pixel_direction(
+                    camera, float2{ static_cast<float>(x), static_cast<float>(y) } + jitter));
+
+                // Inverse of pixel_direction for the previous camera
+                const auto& previous = previous_camera;
+                float3 to_point = point - previous.position;
+                float along = dot(to_point, previous.direction) / dot(previous.direction, previous.direction);
+                if (along <= 0.0f) {
+                    continue;
+                }
+                float u = dot(to_point, previous.right) / (along * dot(previous.right, previous.right)) / aspect_ratio;
+                float v = -dot(to_point, previous.up) / (along * dot(previous.up, previous.up));
+                float previous_x = std::round((u + 1.0f) * static_cast<float>(width  - 1) / 2.0f - jitter.x);
+                float previous_y = std::round((v + 1.0f) * static_cast<float>(height - 1) / 2.0f - jitter.y);
+                if (previous_x < 0.0f || previous_y < 0.0f ||
+                    previous_x >= static_cast<float>(width) || previous_y >= static_cast<float>(height)) {
+                    continue;
+                }
+                size_t source_x = static_cast<size_t>(previous_x);
+                size_t source_y = static_cast<size_t>(previous_y);
+
+                float expected = length(to_point);
+                float previous_distance = previous_depth->item(source_x, source_y);
+                if (previous_distance == FLT_MAX ||
+                    std::abs(previous_distance - expected) > disocclusion_tolerance * expected) {
+                    continue;
+                }
+
+                float samples = std::min(previous_history_length->item(source_x, source_y) + 1.0f, max_history);
+                auto& history_pixel = history->item(x, y);
+                history_pixel = lerp(previous_history->item(source_x, source_y), history_pixel, 1.0f / samples);
+                history_length->item(x, y) = samples;
+                ++reprojected;
+            }
+        }
+        pixels_reprojected = static_cast<size_t>(reprojected);
+
+#pragma omp parallel for
+        for (int y = 0; y < static_cast<int>(height); ++y) {
+            for (size_t x = 0; x < width; ++x) {
+                render_target->item(x, y) = RT::from_float3(history->item(x, y));
+            }
+        }
+
+        *previous_history = *history;
+        std::swap(previous_depth, primary_depth);
+        std::swap(previous_history_length, history_length);
+        previous_camera = camera;
+        previous_valid = true;
+    }
+
     template<typename VB, typename RT>
     inline payload raytracer<VB, RT>::trace_ray(
             const ray& ray, size_t depth, float max_t, float min_t) const
@@ -231,33 +893,79 @@ namespace cg::renderer
         }
         --depth;
 
+        const triangle<VB>* closest_triangle = nullptr;
+        payload closest_hit_payload = find_hit(ray, max_t, min_t, closest_triangle);
+        return shade_hit(ray, closest_hit_payload, closest_triangle, depth);
+    }
+
+    template<typename VB, typename RT>
+    inline payload raytracer<VB, RT>::find_hit(
+            const ray& ray, float max_t, float min_t, const triangle<VB>*& hit_triangle) const
+    {
         payload closest_hit_payload = {};
         closest_hit_payload.t = max_t;
-        const triangle<VB>* closest_triangle = nullptr;
+        hit_triangle = nullptr;
 
-        for (auto& aabb : acceleration_structures) {
+        for (size_t shape_id = 0; shape_id < acceleration_structures.size(); ++shape_id) {
+            size_t lod_id = select_lod(shape_id, ray);
+            const auto& aabb = lod_id == 0 ?
+                acceleration_structures[shape_id] :
+                lod_acceleration_structures[shape_id][lod_id - 1];
             if (!aabb.aabb_test(ray)) {
                 continue;
             }
+            // A ray leaving the full detail surface would hit the simplified
+            // copy of it within the LOD error
+            float shape_min_t = lod_id == 0 ? min_t : std::max(min_t, lod_errors[shape_id][lod_id - 1]);
             for (auto& triangle : aabb.get_triangles()) {
                 payload payload = intersection_shader(triangle, ray);
-                if (payload.t > min_t && payload.t < closest_hit_payload.t) {
+                if (payload.t > shape_min_t && payload.t < closest_hit_payload.t) {
                     closest_hit_payload = payload;
-                    closest_triangle = &triangle;
+                    hit_triangle = &triangle;
                     if (any_hit_shader) {
-                        return any_hit_shader(ray, payload, triangle);
+                        return closest_hit_payload;
                     }
                 }
             }
         }
-        if ((closest_hit_payload.t < max_t) && closest_hit_shader) {
-            return closest_hit_shader(
-                ray, closest_hit_payload, *closest_triangle, depth
-            );
+        return closest_hit_payload;
+    }
+
+    template<typename VB, typename RT>
+    inline payload raytracer<VB, RT>::shade_hit(
+            const ray& ray, payload& hit, const triangle<VB>* hit_triangle, size_t depth) const
+    {
+        if (hit_triangle && any_hit_shader) {
+            return any_hit_shader(ray, hit, *hit_triangle);
+        }
+        if (hit_triangle && closest_hit_shader) {
+            return closest_hit_shader(ray, hit, *hit_triangle, depth);
         }
         return miss_shader(ray);
     }
 
+    template<typename VB, typename RT>
+    inline bool raytracer<VB, RT>::trace_occlusion(const ray& ray, float max_t, float min_t) const
+    {
+        for (size_t shape_id = 0; shape_id < acceleration_structures.size(); ++shape_id) {
+            size_t lod_id = select_lod(shape_id, ray);
+            const auto& aabb = lod_id == 0 ?
+                acceleration_structures[shape_id] :
+                lod_acceleration_structures[shape_id][lod_id - 1];
+            if (!aabb.aabb_test(ray, max_t)) {
+                continue;
+            }
+            float shape_min_t = lod_id == 0 ? min_t : std::max(min_t, lod_errors[shape_id][lod_id - 1]);
+            for (auto& triangle : aabb.get_triangles()) {
+                float t = intersection_shader(triangle, ray).t;
+                if (t > shape_min_t && t < max_t) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
     template<typename VB, typename RT>
     inline payload raytracer<VB, RT>::intersection_shader(
             const triangle<VB>& triangle, const ray& ray) const
@@ -357,4 +1065,21 @@ namespace cg::renderer
         return maxelem(tmin) <= minelem(tmax);
     }
 
+    template<typename VB>
+    inline bool aabb<VB>::aabb_test(const ray& ray, float max_t) const
+    {
+        float3 inverted_ray_direction = float3(1.0f) / ray.direction;
+        float3 t0 = (aabb_max - ray.position) * inverted_ray_direction;
+        float3 t1 = (aabb_min - ray.position) * inverted_ray_direction;
+        float t_enter = maxelem(min(t0, t1));
+        float t_exit = minelem(max(t0, t1));
+        return t_enter <= t_exit && t_exit >= 0.0f && t_enter <= max_t;
+    }
+
+    template<typename VB>
+    inline float aabb<VB>::distance(const float3& point) const
+    {
+        return length(max(max(aabb_min - point, point - aabb_max), float3(0.0f)));
+    }
+
 }// namespace cg::renderer
\ No newline at end of file
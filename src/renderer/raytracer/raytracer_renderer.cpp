@@ -2,9 +2,23 @@
 
 #include "utils/resource_utils.h"
 
+#include <atomic>
+#include <cfloat>
+#include <csignal>
 #include <iostream>
 
 
+namespace
+{
+    // Set by Ctrl+C during progressive rendering, which then keeps its whole frames
+    std::atomic<bool> cancel_requested{ false };
+
+    void request_cancel(int)
+    {
+        cancel_requested = true;
+    }
+}// namespace
+
 void cg::renderer::ray_tracing_renderer::init()
 {
     model = std::make_shared<cg::world::model>();
@@ -33,6 +47,12 @@ void cg::renderer::ray_tracing_renderer::init()
     raytracer->set_viewport(settings->width, settings->height);
     raytracer->set_vertex_buffers(model->get_vertex_buffers());
     raytracer->set_index_buffers(model->get_index_buffers());
+    raytracer->set_lods(model->get_lods());
+    raytracer->set_lod_threshold(settings->lod_threshold);
+    raytracer->set_primary_hit_cache(settings->primary_hit_cache);
+    raytracer->set_temporal_reprojection(settings->temporal_reprojection);
+    // Once, the geometry is static: rebuilding would also drop the primary hit cache
+    raytracer->build_acceleration_structure();
 
     lights.push_back({
         float3{ 0, 1.58f, -0.03f },
@@ -40,14 +60,33 @@ void cg::renderer::ray_tracing_renderer::init()
     });
 
     shadow_raytracer = std::make_shared<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>>();
+    shadow_raytracer->set_lod_threshold(settings->lod_threshold);
+    shadow_raytracer->acceleration_structures = raytracer->acceleration_structures;
+    shadow_raytracer->lod_acceleration_structures = raytracer->lod_acceleration_structures;
+    shadow_raytracer->lod_errors = raytracer->lod_errors;
+
+    // Once per run, whatever the number of frames
+    if (!settings->bake_irradiance.empty()) {
+        bake_irradiance();
+    }
 }
 
 void cg::renderer::ray_tracing_renderer::destroy() {}
 
-void cg::renderer::ray_tracing_renderer::update() {}
+void cg::renderer::ray_tracing_renderer::update()
+{
+    if (frames_rendered > 0) {
+        move_yaw(settings->camera_yaw_step);
+    }
+}
 
 void cg::renderer::ray_tracing_renderer::render()
 {
+    // Baking replaces rendering, see init
+    if (!settings->bake_irradiance.empty()) {
+        return;
+    }
+
     raytracer->clear_render_target({ 0, 0, 0 });
     raytracer->miss_shader = [](const ray& ray) {
         payload payload{};
@@ -59,6 +98,9 @@ void cg::renderer::ray_tracing_renderer::render()
     std::mt19937 rng(random_device());
     std::uniform_real_distribution<float> uniform_distribution(-1.0f, 1.0f);
 
+    // Primary rays are one pixel apart, 2 / height per unit of distance
+    float pixel_spread = 2.0f / static_cast<float>(settings->height);
+
 
     raytracer->closest_hit_shader = [&](const ray& ray,
             payload& payload,
@@ -75,6 +117,8 @@ void cg::renderer::ray_tracing_renderer::render()
 
         for (auto& light : lights) {
             cg::renderer::ray to_light(position, light.position - position);
+            // Shadow rays keep the width of the pixel cone at the hit point
+            to_light.footprint = std::max(ray.footprint_at(payload.t), pixel_spread * payload.t);
 
             auto shadow_payload = shadow_raytracer->trace_ray(
                 to_light, 1, length(light.position - position)
@@ -95,7 +139,6 @@ void cg::renderer::ray_tracing_renderer::render()
         payload.color = cg::color::from_float3(result_color);
         return payload;
     };
-    raytracer->build_acceleration_structure();
 
 
     shadow_raytracer->miss_shader = [](const ray& ray) {
@@ -110,23 +153,234 @@ void cg::renderer::ray_tracing_renderer::render()
     {
         return payload;
     };
-    shadow_raytracer->acceleration_structures = raytracer->acceleration_structures;
 
+    size_t depth = settings->raytracing_depth;
+    bool progressive = settings->time_budget > 0.f || settings->target_noise > 0.f || !settings->checkpoint.empty();
+    if (settings->ao_samples > 0) {
+        // Fraction of short cosine rays that escape, no materials and no lights.
+        // ray_generation sums sqrt(color / accumulation_num) over the frames, so the
+        // payload is set for the image to show the fraction itself. Progressive
+        // rendering averages the fraction and shows the mean as it is
+        float frames = static_cast<float>(std::max(settings->accumulation_num, 1u));
+        auto ao_color = [progressive, frames](float visibility) {
+            float value = progressive ? visibility : visibility * visibility / frames;
+            return cg::color{ value, value, value };
+        };
+        raytracer->miss_shader = [ao_color](const ray& ray) {
+            payload payload{};
+            payload.color = ao_color(1.0f);
+            return payload;
+        };
+        raytracer->closest_hit_shader = [&, ao_color](const ray& ray,
+                payload& payload,
+                const triangle<cg::vertex>& triangle,
+                size_t depth)
+        {
+            static thread_local std::mt19937 generator(std::random_device{}());
+            float3 position = ray.position + ray.direction * payload.t;
+            float3 normal = normalize(
+                payload.bary.x * triangle.na +
+                payload.bary.y * triangle.nb +
+                payload.bary.z * triangle.nc
+            );
+            if (dot(normal, ray.direction) > 0.0f) {
+                normal = -normal;
+            }
+            size_t unoccluded = 0;
+            for (size_t sample = 0; sample < settings->ao_samples; ++sample) {
+                cg::renderer::ray occlusion_ray(position, cosine_sample_hemisphere(normal, generator));
+                if (!raytracer->trace_occlusion(occlusion_ray, settings->ao_distance)) {
+                    ++unoccluded;
+                }
+            }
+            payload.color = ao_color(static_cast<float>(unoccluded) / settings->ao_samples);
+            return payload;
+        };
+        // Primary rays only, occlusion rays do not recurse
+        depth = 1;
+    }
 
 
     auto start = std::chrono::high_resolution_clock::now();
 
-    raytracer->ray_generation(
-        camera->get_position(), camera->get_direction(),
-        camera->get_right(), camera->get_up(),
-        settings->raytracing_depth,
-        settings->accumulation_num
-    );
+    cg::renderer::progressive_result progress_result{};
+    if (progressive) {
+        cg::renderer::progressive_settings<cg::unsigned_color> progress;
+        progress.time_budget = std::chrono::duration<float, std::milli>(settings->time_budget);
+        progress.target_noise = settings->target_noise;
+        progress.max_frames = settings->max_progressive_frames;
+        progress.linear_output = settings->ao_samples > 0;
+        progress.image_interval = std::chrono::duration<float, std::milli>(settings->image_interval);
+        // Written next to the result and renamed over it, a viewer never reads half an image
+        progress.on_image = [&](cg::resource<cg::unsigned_color>& image, size_t frames) {
+            std::filesystem::path partial_path = settings->result_path;
+            partial_path += ".partial";
+            cg::utils::save_resource(image, partial_path, false);
+            std::filesystem::rename(partial_path, settings->result_path);
+            std::cout << "Intermediate image of " << frames << " frames saved" << std::endl;
+        };
+        progress.cancel = &cancel_requested;
+        progress.checkpoint_path = settings->checkpoint;
+        progress.checkpoint_interval = std::chrono::duration<float, std::milli>(settings->checkpoint_interval);
+        progress.resume = settings->resume;
+        if (settings->ao_samples > 0) {
+            progress.ao_samples = settings->ao_samples;
+            progress.ao_distance = settings->ao_distance;
+        }
+
+        cancel_requested = false;
+        auto previous_handler = std::signal(SIGINT, request_cancel);
+        progress_result = raytracer->progressive_generation(
+            camera->get_position(), camera->get_direction(),
+            camera->get_right(), camera->get_up(),
+            depth,
+            progress
+        );
+        std::signal(SIGINT, previous_handler);
+    }
+    else {
+        raytracer->ray_generation(
+            camera->get_position(), camera->get_direction(),
+            camera->get_right(), camera->get_up(),
+            depth,
+            settings->accumulation_num
+        );
+    }
 
     auto end = std::chrono::high_resolution_clock::now();
 
     std::chrono::duration<float, std::milli> raytracing_duration = end - start;
+    if (settings->ao_samples > 0) {
+        std::cout << "Ambient occlusion: " << settings->ao_samples << " rays per hit, up to "
+                  << settings->ao_distance << " long" << std::endl;
+    }
     std::cout << "Raytracing took " << raytracing_duration.count() << " ms" << std::endl;
+    if (progressive) {
+        const char* stop_reasons[] = { "frame limit", "deadline", "noise target", "cancellation" };
+        std::cout << "Progressive: " << progress_result.frames << " frames in " << progress_result.passes
+                  << " passes, noise " << progress_result.noise << ", stopped by the "
+                  << stop_reasons[static_cast<int>(progress_result.stopped_by)] << std::endl;
+        if (progress_result.resumed_frames > 0) {
+            std::cout << "Resumed " << progress_result.resumed_frames << " frames from " << settings->checkpoint << std::endl;
+        }
+    }
+    if (settings->temporal_reprojection) {
+        std::cout << "Pixels reprojected from the previous frame: " << raytracer->get_pixels_reprojected() << std::endl;
+    }
+    if (settings->primary_hit_cache) {
+        std::cout << "Primary hits reused from the cache: " << raytracer->get_primary_hits_reused() << std::endl;
+    }
 
     cg::utils::save_resource(*render_target, settings->result_path);
+    ++frames_rendered;
+}
+
+void cg::renderer::ray_tracing_renderer::bake_irradiance()
+{
+    // Every thread seeds its generator per vertex, so bakes are reproducible
+    static thread_local std::mt19937 generator;
+
+    shadow_raytracer->miss_shader = [](const ray& ray) {
+        payload payload{};
+        payload.t = -1.0f;
+        return payload;
+    };
+    shadow_raytracer->any_hit_shader = [](
+            const ray& ray,
+            payload& payload,
+            const triangle<cg::vertex>& triangle)
+    {
+        return payload;
+    };
+
+    auto direct_light = [&](float3 position, float3 normal) {
+        float3 result_color = { 0.0f, 0.0f, 0.0f };
+        for (auto& light : lights) {
+            cg::renderer::ray to_light(position, light.position - position);
+            auto shadow_payload = shadow_raytracer->trace_ray(
+                to_light, 1, length(light.position - position)
+            );
+            if (shadow_payload.t >= 0.0f) {
+                continue;
+            }
+            result_color += (light.color / 2) * std::max(dot(normal, to_light.direction), 0.0f);
+        }
+        return result_color;
+    };
+
+    // Nothing outside of the scene emits, a lost ray gathers no light
+    raytracer->miss_shader = [](const ray& ray) {
+        payload payload{};
+        payload.color = { 0.0f, 0.0f, 0.0f };
+        return payload;
+    };
+    // Direct light plus one cosine-sampled bounce per remaining depth
+    raytracer->closest_hit_shader = [&](const ray& ray,
+            payload& payload,
+            const triangle<cg::vertex>& triangle,
+            size_t depth)
+    {
+        float3 position = ray.position + ray.direction * payload.t;
+        float3 normal = normalize(
+            payload.bary.x * triangle.na +
+            payload.bary.y * triangle.nb +
+            payload.bary.z * triangle.nc
+        );
+        if (dot(normal, ray.direction) > 0.0f) {
+            normal = -normal;
+        }
+        float3 irradiance = direct_light(position, normal);
+        if (depth > 0) {
+            cg::renderer::ray bounce(position, cosine_sample_hemisphere(normal, generator));
+            irradiance += raytracer->trace_ray(bounce, depth).color.to_float3();
+        }
+        payload.color = cg::color::from_float3(triangle.diffuse * irradiance);
+        return payload;
+    };
+
+    // Gather rays skip the geometry right next to the vertex: a vertex on the
+    // corner of two walls would otherwise see half of its hemisphere blocked,
+    // and darken the whole triangles it is interpolated over
+    float3 scene_min{ FLT_MAX, FLT_MAX, FLT_MAX };
+    float3 scene_max{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (const auto& bounding_box : model->get_bounding_boxes()) {
+        scene_min = min(scene_min, bounding_box.min);
+        scene_max = max(scene_max, bounding_box.max);
+    }
+    float gather_min_t = 0.01f * length(scene_max - scene_min);
+
+    cg::renderer::irradiance_cache cache;
+    cache.resize(model->get_vertex_buffers());
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    size_t num_vertices = 0;
+    for (size_t shape_id = 0; shape_id < model->get_vertex_buffers().size(); ++shape_id) {
+        const auto& vertex_buffer = model->get_vertex_buffers()[shape_id];
+#pragma omp parallel for schedule(dynamic)
+        for (int vertex_id = 0; vertex_id < static_cast<int>(vertex_buffer->get_number_of_elements()); ++vertex_id) {
+            generator.seed(static_cast<unsigned>(num_vertices + vertex_id));
+            const auto& vertex = vertex_buffer->item(vertex_id);
+            float3 position{ vertex.x, vertex.y, vertex.z };
+            float3 normal = normalize(float3{ vertex.nx, vertex.ny, vertex.nz });
+
+            float3 indirect = { 0.0f, 0.0f, 0.0f };
+            for (size_t sample = 0; sample < settings->bake_samples; ++sample) {
+                cg::renderer::ray gather(position, cosine_sample_hemisphere(normal, generator));
+                indirect += raytracer->trace_ray(
+                    gather, settings->raytracing_depth, 1000.f, gather_min_t).color.to_float3();
+            }
+            cache.item(shape_id, vertex_id) =
+                direct_light(position, normal) + indirect / static_cast<float>(std::max(settings->bake_samples, 1u));
+        }
+        num_vertices += vertex_buffer->get_number_of_elements();
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<float, std::milli> baking_duration = end - start;
+    std::cout << "Baked irradiance of " << num_vertices << " vertices, " << settings->bake_samples
+              << " rays each, took " << baking_duration.count() << " ms" << std::endl;
+
+    cache.save(settings->bake_irradiance);
 }
\ No newline at end of file
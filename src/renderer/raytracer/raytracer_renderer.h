@@ -1,3 +1,4 @@
+#include "renderer/raytracer/irradiance_cache.h"
 #include "renderer/raytracer/raytracer.h"
 #include "renderer/renderer.h"
 #include "resource.h"
@@ -15,11 +16,15 @@ namespace cg::renderer
         virtual void render();
 
     protected:
+        // Multi-bounce irradiance of every vertex into settings->bake_irradiance
+        void bake_irradiance();
+
         std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
 
         std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> raytracer;
         std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> shadow_raytracer;
 
         std::vector<cg::renderer::light> lights;
+        size_t frames_rendered = 0;
     };
 }// namespace cg::renderer
\ No newline at end of file
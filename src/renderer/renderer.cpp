@@ -10,6 +10,10 @@
 #include "renderer/raytracer/raytracer_renderer.h"
 #endif
 
+#ifdef HYBRID
+#include "renderer/hybrid/hybrid_renderer.h"
+#endif
+
 #ifdef DX12
 #include "renderer/dx12/dx12_renderer.h"
 #endif
@@ -45,6 +49,11 @@ std::shared_ptr<renderer> cg::renderer::make_renderer(std::shared_ptr<cg::settin
     renderer->set_settings(settings);
     return renderer;
 #endif
+#ifdef HYBRID
+    auto renderer = std::make_shared<cg::renderer::hybrid_renderer>();
+    renderer->set_settings(settings);
+    return renderer;
+#endif
 #ifdef DX12
     auto renderer = std::make_shared<cg::renderer::dx12_renderer>();
     renderer->set_settings(settings);
@@ -86,12 +95,13 @@ void cg::renderer::renderer::move_right(float delta)
     );
 }
 
+// Camera angles are set in degrees and read back in radians
 void cg::renderer::renderer::move_yaw(float delta)
 {
-    camera->set_theta(camera->get_theta() + delta);
+    camera->set_theta(camera->get_theta() * 180.f / static_cast<float>(M_PI) + delta);
 }
 
 void cg::renderer::renderer::move_pitch(float delta)
 {
-    camera->set_phi(camera->get_phi() + delta);
+    camera->set_phi(camera->get_phi() * 180.f / static_cast<float>(M_PI) + delta);
 }
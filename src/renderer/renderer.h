@@ -7,6 +7,19 @@
 
 namespace cg::renderer
 {
+    struct light
+    {
+        float3 position;
+        float3 color;
+    };
+
+    struct directional_light
+    {
+        // From the light towards the scene
+        float3 direction;
+        float3 color;
+    };
+
     class renderer
     {
     public:
@@ -124,6 +124,10 @@ namespace cg
         {
             return float3{ (float)r, (float)b, (float)g };
         };
+        color to_color() const
+        {
+            return color{ r / 255.0f, g / 255.0f, b / 255.0f };
+        }
         unsigned char r;
         unsigned char g;
         unsigned char b;
@@ -156,4 +160,54 @@ namespace cg
         float v;
     };
 
+
+    // Compile-time list of VB fields to interpolate across a triangle
+    template<auto... Fields>
+    struct attribute_layout
+    {
+        static constexpr size_t size = sizeof...(Fields);
+
+        template<typename VB>
+        static void interpolate(
+                VB& result, const VB& a, const VB& b, const VB& c, const float3& bary)
+        {
+            ((result.*Fields = bary.x * (a.*Fields) + bary.y * (b.*Fields) + bary.z * (c.*Fields)), ...);
+        }
+    };
+
+    template<typename... Layouts>
+    struct join_layouts;
+
+    template<auto... Fields>
+    struct join_layouts<attribute_layout<Fields...>>
+    {
+        using type = attribute_layout<Fields...>;
+    };
+
+    template<auto... A, auto... B, typename... Rest>
+    struct join_layouts<attribute_layout<A...>, attribute_layout<B...>, Rest...>
+        : join_layouts<attribute_layout<A..., B...>, Rest...>
+    {
+    };
+
+    template<typename... Layouts>
+    using join_layouts_t = typename join_layouts<Layouts...>::type;
+
+    // Named attribute groups of a vertex type, specialized per VB
+    template<typename VB>
+    struct vertex_layout;
+
+    template<>
+    struct vertex_layout<vertex>
+    {
+        using position = attribute_layout<&vertex::x, &vertex::y, &vertex::z>;
+        using normal   = attribute_layout<&vertex::nx, &vertex::ny, &vertex::nz>;
+        using ambient  = attribute_layout<&vertex::ambient_r, &vertex::ambient_g, &vertex::ambient_b>;
+        using diffuse  = attribute_layout<&vertex::diffuse_r, &vertex::diffuse_g, &vertex::diffuse_b>;
+        using emissive = attribute_layout<&vertex::emissive_r, &vertex::emissive_g, &vertex::emissive_b>;
+        using texcoord = attribute_layout<&vertex::u, &vertex::v>;
+
+        using all = join_layouts_t<position, normal, ambient, diffuse, emissive, texcoord>;
+    };
+
 }// namespace cg
\ No newline at end of file
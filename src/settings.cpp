@@ -23,8 +23,38 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
     add_options("camera_z_near", "Minimum expected depth", cxxopts::value<float>()->default_value("0.001"));
     add_options("camera_z_far", "Maximum expected depth", cxxopts::value<float>()->default_value("100.0"));
     add_options("result_path", "Path to resulted image", cxxopts::value<std::filesystem::path>()->default_value("result.png"));
+    add_options("cull_mode", "Rasterizer face culling: back (the winding the rasterizer always drew), none (also draws back faces) or front; counter-clockwise is front", cxxopts::value<std::string>()->default_value("back"));
+    add_options("shading", "Rasterizer shading: forward, deferred (G-buffer) or visibility (triangle-id buffer)", cxxopts::value<std::string>()->default_value("forward"));
+    add_options("depth_prepass", "Rasterizer depth pre-pass before shading", cxxopts::value<bool>()->default_value("false"));
+    add_options("lod_threshold", "Largest LOD error allowed, in pixels for rasterization and in ray footprints for raytracing, 0 keeps full detail", cxxopts::value<float>()->default_value("1.0"));
+    add_options("msaa", "Rasterizer samples per pixel: 1, 4 or 8", cxxopts::value<unsigned>()->default_value("1"));
+    add_options("point_light", "Rasterization target adds the point light of the Raytracing target to the ambient", cxxopts::value<bool>()->default_value("false"));
+    add_options("shadows", "Rasterizer shadow maps", cxxopts::value<bool>()->default_value("false"));
+    add_options("shadow_map_size", "Shadow map width and height", cxxopts::value<unsigned>()->default_value("1024"));
+    add_options("shadow_cascades", "Shadow map cascades of the sun", cxxopts::value<unsigned>()->default_value("3"));
+    add_options("sun_direction", "Direction of an additional directional light", cxxopts::value<std::vector<float>>());
+    add_options("instances", "Copies of the model on a grid, drawn by the rasterizer with instanced draws", cxxopts::value<unsigned>()->default_value("1"));
+    add_options("record_threads", "Rasterizer command lists recorded in parallel and replayed sorted by pipeline and depth, 0 draws immediately", cxxopts::value<unsigned>()->default_value("0"));
+    add_options("depth_format", "Rasterizer depth storage: float32, unorm24 or unorm16", cxxopts::value<std::string>()->default_value("float32"));
     add_options("raytracing_depth", "Maximum number of traces rays", cxxopts::value<unsigned>()->default_value("4"));
     add_options("accumulation_num", "Number of accumulated frames", cxxopts::value<unsigned>()->default_value("4"));
+    add_options("reflectivity", "Fraction of light every surface mirrors in the Hybrid target, 0 traces no reflection rays", cxxopts::value<float>()->default_value("0.0"));
+    add_options("bake_irradiance", "Raytracing target bakes per-vertex irradiance into this file instead of rendering", cxxopts::value<std::filesystem::path>()->default_value(""));
+    add_options("irradiance_cache", "Rasterization target is lit by the per-vertex irradiance baked into this file", cxxopts::value<std::filesystem::path>()->default_value(""));
+    add_options("bake_samples", "Rays per vertex when baking irradiance", cxxopts::value<unsigned>()->default_value("256"));
+    add_options("ao_samples", "Occlusion rays per hit of an ambient occlusion only render of the Raytracing target, 0 renders lit", cxxopts::value<unsigned>()->default_value("0"));
+    add_options("ao_distance", "Length of ambient occlusion rays", cxxopts::value<float>()->default_value("0.5"));
+    add_options("primary_hit_cache", "Raytracing target keeps primary hits and reuses them while the camera and geometry stay the same", cxxopts::value<bool>()->default_value("false"));
+    add_options("frames", "Number of frames rendered in a row", cxxopts::value<unsigned>()->default_value("1"));
+    add_options("temporal_reprojection", "Raytracing target blends every frame with the previous one, reprojected across camera motion", cxxopts::value<bool>()->default_value("false"));
+    add_options("camera_yaw_step", "Camera yaw added before every frame after the first, in degrees", cxxopts::value<float>()->default_value("0.0"));
+    add_options("time_budget", "Raytracing target renders progressively until this many milliseconds pass, 0 for no deadline", cxxopts::value<float>()->default_value("0.0"));
+    add_options("target_noise", "Raytracing target renders progressively until the mean standard error of pixel luminance drops to this, 0 for no target", cxxopts::value<float>()->default_value("0.0"));
+    add_options("max_progressive_frames", "Most frames of progressive rendering, 0 for no limit", cxxopts::value<unsigned>()->default_value("1024"));
+    add_options("image_interval", "Milliseconds between intermediate images of progressive rendering, 0 for none", cxxopts::value<float>()->default_value("0.0"));
+    add_options("checkpoint", "Raytracing target renders progressively and saves its sums to this file, empty for none", cxxopts::value<std::filesystem::path>()->default_value(""));
+    add_options("checkpoint_interval", "Milliseconds between checkpoints", cxxopts::value<float>()->default_value("60000.0"));
+    add_options("resume", "Continue from the checkpoint if it exists", cxxopts::value<bool>()->default_value("false"));
     add_options("h,help", "Print usage");
 
     auto result = options.parse(argc, argv);
@@ -44,8 +74,40 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
     settings->camera_z_near = result["camera_z_near"].as<float>();
     settings->camera_z_far = result["camera_z_far"].as<float>();
     settings->result_path = result["result_path"].as<std::filesystem::path>();
+    settings->cull_mode = result["cull_mode"].as<std::string>();
+    settings->shading = result["shading"].as<std::string>();
+    settings->depth_prepass = result["depth_prepass"].as<bool>();
+    settings->lod_threshold = result["lod_threshold"].as<float>();
+    settings->msaa = result["msaa"].as<unsigned>();
+    settings->point_light = result["point_light"].as<bool>();
+    settings->shadows = result["shadows"].as<bool>();
+    settings->shadow_map_size = result["shadow_map_size"].as<unsigned>();
+    settings->shadow_cascades = result["shadow_cascades"].as<unsigned>();
+    if (result.count("sun_direction")) {
+        settings->sun_direction = result["sun_direction"].as<std::vector<float>>();
+    }
+    settings->instances = result["instances"].as<unsigned>();
+    settings->record_threads = result["record_threads"].as<unsigned>();
+    settings->depth_format = result["depth_format"].as<std::string>();
     settings->raytracing_depth = result["raytracing_depth"].as<unsigned>();
     settings->accumulation_num = result["accumulation_num"].as<unsigned>();
+    settings->reflectivity = result["reflectivity"].as<float>();
+    settings->bake_irradiance = result["bake_irradiance"].as<std::filesystem::path>();
+    settings->irradiance_cache = result["irradiance_cache"].as<std::filesystem::path>();
+    settings->bake_samples = result["bake_samples"].as<unsigned>();
+    settings->ao_samples = result["ao_samples"].as<unsigned>();
+    settings->ao_distance = result["ao_distance"].as<float>();
+    settings->primary_hit_cache = result["primary_hit_cache"].as<bool>();
+    settings->frames = result["frames"].as<unsigned>();
+    settings->temporal_reprojection = result["temporal_reprojection"].as<bool>();
+    settings->camera_yaw_step = result["camera_yaw_step"].as<float>();
+    settings->time_budget = result["time_budget"].as<float>();
+    settings->target_noise = result["target_noise"].as<float>();
+    settings->max_progressive_frames = result["max_progressive_frames"].as<unsigned>();
+    settings->image_interval = result["image_interval"].as<float>();
+    settings->checkpoint = result["checkpoint"].as<std::filesystem::path>();
+    settings->checkpoint_interval = result["checkpoint_interval"].as<float>();
+    settings->resume = result["resume"].as<bool>();
 
     return settings;
 }
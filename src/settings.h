@@ -25,8 +25,39 @@ namespace cg
 
         std::filesystem::path result_path;
 
+        std::string cull_mode;
+        std::string shading;
+        bool depth_prepass;
+        float lod_threshold;
+        unsigned msaa;
+        bool point_light;
+        bool shadows;
+        unsigned shadow_map_size;
+        unsigned shadow_cascades;
+        std::vector<float> sun_direction;
+        unsigned instances;
+        unsigned record_threads;
+        std::string depth_format;
+
         unsigned raytracing_depth;
         unsigned accumulation_num;
+        float reflectivity;
+        std::filesystem::path bake_irradiance;
+        std::filesystem::path irradiance_cache;
+        unsigned bake_samples;
+        unsigned ao_samples;
+        float ao_distance;
+        bool primary_hit_cache;
+        unsigned frames;
+        bool temporal_reprojection;
+        float camera_yaw_step;
+        float time_budget;
+        float target_noise;
+        unsigned max_progressive_frames;
+        float image_interval;
+        std::filesystem::path checkpoint;
+        float checkpoint_interval;
+        bool resume;
     };
 
 }// namespace cg
\ No newline at end of file
@@ -11,7 +11,7 @@
 using namespace cg::utils;
 
 void cg::utils::save_resource(
-		cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath)
+		cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath, bool open_viewer)
 {
 	int width = static_cast<int>(render_target.get_stride());
 	int height = static_cast<int>(render_target.get_number_of_elements()) / width;
@@ -23,6 +23,9 @@ void cg::utils::save_resource(
 	if (result != 1)
 		THROW_ERROR("Can't save the resource");
 
+	if (!open_viewer)
+		return;
+
 	std::string view_command("start ");
 	view_command.append(filepath.string());
 
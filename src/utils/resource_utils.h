@@ -7,5 +7,6 @@
 
 namespace cg::utils
 {
-	void save_resource(cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath);
+	// Opens the saved image in the default viewer unless open_viewer is false
+	void save_resource(cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath, bool open_viewer = true);
 }
\ No newline at end of file
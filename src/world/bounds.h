@@ -0,0 +1,107 @@
+#pragma once
+
+#include <array>
+#include <linalg.h>
+
+
+using namespace linalg::aliases;
+
+namespace cg::world
+{
+    struct bounding_box
+    {
+        float3 min;
+        float3 max;
+    };
+
+    struct bounding_sphere
+    {
+        float3 center;
+        float radius;
+    };
+
+    // Spread of the face normals of a cluster: every normal n has
+    // dot(n, axis) >= sqrt(1 - cutoff^2), cutoff is 1 when the spread reaches 90 degrees
+    struct normal_cone
+    {
+        float3 axis;
+        float cutoff;
+    };
+
+    // A contiguous run of triangles of an index buffer
+    struct meshlet
+    {
+        static constexpr size_t max_vertices = 64;
+        static constexpr size_t max_triangles = 124;
+
+        size_t index_offset;
+        size_t index_count;
+        // Run of the vertex list of the level holding every vertex of the meshlet once
+        size_t vertex_offset;
+        size_t vertex_count;
+
+        bounding_sphere sphere;
+        normal_cone cone;
+    };
+
+    // Six planes of a view volume, normals point inside
+    class frustum
+    {
+    public:
+        // Planes of the clip volume 0 <= z <= w, -w <= x, y <= w in the space
+        // the matrix transforms from (world space for projection * view)
+        static frustum from_matrix(const float4x4& matrix);
+
+        bool intersects(const bounding_sphere& sphere) const;
+        bool intersects(const bounding_box& box) const;
+
+    protected:
+        std::array<float4, 6> planes;
+    };
+
+    inline frustum frustum::from_matrix(const float4x4& matrix)
+    {
+        float4x4 rows = transpose(matrix);
+
+        frustum result;
+        result.planes = {
+            rows[3] + rows[0],
+            rows[3] - rows[0],
+            rows[3] + rows[1],
+            rows[3] - rows[1],
+            rows[2],
+            rows[3] - rows[2]
+        };
+        for (auto& plane : result.planes) {
+            plane /= length(float3{ plane.x, plane.y, plane.z });
+        }
+        return result;
+    }
+
+    inline bool frustum::intersects(const bounding_sphere& sphere) const
+    {
+        for (const auto& plane : planes) {
+            float3 normal{ plane.x, plane.y, plane.z };
+            if (dot(normal, sphere.center) + plane.w < -sphere.radius) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    inline bool frustum::intersects(const bounding_box& box) const
+    {
+        for (const auto& plane : planes) {
+            // The corner furthest along the plane normal
+            float3 corner{
+                plane.x > 0 ? box.max.x : box.min.x,
+                plane.y > 0 ? box.max.y : box.min.y,
+                plane.z > 0 ? box.max.z : box.min.z
+            };
+            if (dot(float3{ plane.x, plane.y, plane.z }, corner) + plane.w < 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+}// namespace cg::world
@@ -144,3 +144,19 @@ const float camera::get_phi() const
 {
     return phi;
 }
+const float camera::get_angle_of_view() const
+{
+    return angle_of_view;
+}
+const float camera::get_aspect_ratio() const
+{
+    return aspect_ratio;
+}
+const float camera::get_z_near() const
+{
+    return z_near;
+}
+const float camera::get_z_far() const
+{
+    return z_far;
+}
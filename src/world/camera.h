@@ -39,6 +39,10 @@ namespace cg::world
         const float3 get_up() const;
         const float get_theta() const;
         const float get_phi() const;
+        const float get_angle_of_view() const;
+        const float get_aspect_ratio() const;
+        const float get_z_near() const;
+        const float get_z_far() const;
 
     protected:
         float3 position;
@@ -0,0 +1,336 @@
+#include "mesh_simplifier.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <numeric>
+#include <tuple>
+
+
+using namespace linalg::aliases;
+
+namespace
+{
+    float3 face_normal(const float3& a, const float3& b, const float3& c)
+    {
+        return cross(b - a, c - a);
+    }
+}// namespace
+
+void cg::world::mesh_simplifier::quadric::add_plane(const float3& normal, float distance)
+{
+    a00 += normal.x * normal.x;
+    a01 += normal.x * normal.y;
+    a02 += normal.x * normal.z;
+    a11 += normal.y * normal.y;
+    a12 += normal.y * normal.z;
+    a22 += normal.z * normal.z;
+    b0 += normal.x * distance;
+    b1 += normal.y * distance;
+    b2 += normal.z * distance;
+    c += distance * distance;
+    planes += 1;
+}
+
+void cg::world::mesh_simplifier::quadric::add(const quadric& other)
+{
+    a00 += other.a00;
+    a01 += other.a01;
+    a02 += other.a02;
+    a11 += other.a11;
+    a12 += other.a12;
+    a22 += other.a22;
+    b0 += other.b0;
+    b1 += other.b1;
+    b2 += other.b2;
+    c += other.c;
+    planes += other.planes;
+}
+
+double cg::world::mesh_simplifier::quadric::evaluate(const float3& p) const
+{
+    double x = p.x, y = p.y, z = p.z;
+    double result =
+        a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z +
+        a11 * y * y + 2 * a12 * y * z + a22 * z * z +
+        2 * (b0 * x + b1 * y + b2 * z) + c;
+    return std::max(result, 0.0);
+}
+
+cg::world::mesh_simplifier::mesh_simplifier(
+        const std::vector<float3>& in_positions, const std::vector<unsigned int>& in_indexes) :
+    positions(in_positions),
+    indexes(in_indexes),
+    removed(in_indexes.size() / 3, false),
+    num_triangles_left(in_indexes.size() / 3),
+    quadrics(in_positions.size()),
+    vertex_triangles(in_positions.size()),
+    locked(in_positions.size(), false),
+    versions(in_positions.size(), 0),
+    queued_costs(in_positions.size(), DBL_MAX),
+    marks(in_positions.size(), 0)
+{
+    // Seams: vertices split by normals or texture coordinates would tear apart
+    std::vector<unsigned int> by_position(positions.size());
+    std::iota(by_position.begin(), by_position.end(), 0u);
+    auto position_key = [&](unsigned int vertex_id) {
+        const auto& p = positions[vertex_id];
+        return std::make_tuple(p.x, p.y, p.z);
+    };
+    std::sort(by_position.begin(), by_position.end(), [&](unsigned int a, unsigned int b) {
+        return position_key(a) < position_key(b);
+    });
+    for (size_t i = 1; i < by_position.size(); ++i) {
+        if (position_key(by_position[i]) == position_key(by_position[i - 1])) {
+            locked[by_position[i]] = true;
+            locked[by_position[i - 1]] = true;
+        }
+    }
+
+    std::vector<uint64_t> edges;
+    edges.reserve(indexes.size());
+    for (size_t triangle_id = 0; triangle_id < num_triangles_left; ++triangle_id) {
+        const unsigned int* triangle = &indexes[triangle_id * 3];
+        float3 normal = face_normal(positions[triangle[0]], positions[triangle[1]], positions[triangle[2]]);
+        if (length(normal) > 0.f) {
+            normal = normalize(normal);
+        }
+        float distance = -dot(normal, positions[triangle[0]]);
+        for (size_t i = 0; i < 3; ++i) {
+            quadrics[triangle[i]].add_plane(normal, distance);
+            vertex_triangles[triangle[i]].push_back(triangle_id);
+
+            unsigned int a = triangle[i];
+            unsigned int b = triangle[(i + 1) % 3];
+            edges.push_back((static_cast<uint64_t>(std::min(a, b)) << 32) | std::max(a, b));
+        }
+    }
+
+    // An edge used by a single triangle is a border, one used by more is not manifold:
+    // both ends are locked
+    std::sort(edges.begin(), edges.end());
+    for (size_t i = 0; i < edges.size();) {
+        size_t j = i;
+        while (j < edges.size() && edges[j] == edges[i]) {
+            ++j;
+        }
+        if (j - i != 2) {
+            locked[edges[i] >> 32] = true;
+            locked[edges[i] & 0xFFFFFFFF] = true;
+        }
+        i = j;
+    }
+
+    for (unsigned int vertex_id = 0; vertex_id < positions.size(); ++vertex_id) {
+        queue_vertex(vertex_id);
+    }
+}
+
+std::vector<unsigned int> cg::world::mesh_simplifier::simplify(size_t target_triangles, float target_error)
+{
+    while (num_triangles_left > target_triangles && !queue.empty()) {
+        queued_vertex entry = queue.top();
+        queue.pop();
+        if (entry.version != versions[entry.vertex]) {
+            continue;
+        }
+
+        // Quadrics only grow and new edges requeue the vertex, so the queued cost is a
+        // lower bound: the cheapest allowed collapse goes ahead unless it costs more
+        // by now, then it waits in the queue at its real cost
+        get_collapses(entry.vertex);
+        auto allowed = std::find_if(candidates.begin(), candidates.end(), [&](const collapse& candidate) {
+            return can_collapse(candidate.from, candidate.to);
+        });
+        if (allowed == candidates.end() || get_distance(allowed->from, allowed->to) > target_error) {
+            // Out of the queue until its neighborhood changes
+            ++versions[entry.vertex];
+            queued_costs[entry.vertex] = DBL_MAX;
+            continue;
+        }
+        if (allowed->cost > entry.cost) {
+            queue.push({ allowed->cost, entry.vertex, ++versions[entry.vertex] });
+            queued_costs[entry.vertex] = allowed->cost;
+            continue;
+        }
+        apply_collapse(allowed->from, allowed->to);
+    }
+
+    std::vector<unsigned int> result;
+    result.reserve(num_triangles_left * 3);
+    for (size_t triangle_id = 0; triangle_id < removed.size(); ++triangle_id) {
+        if (!removed[triangle_id]) {
+            result.insert(result.end(), &indexes[triangle_id * 3], &indexes[triangle_id * 3] + 3);
+        }
+    }
+    return result;
+}
+
+float cg::world::mesh_simplifier::get_error() const
+{
+    return error;
+}
+
+double cg::world::mesh_simplifier::get_cost(unsigned int from, unsigned int to) const
+{
+    quadric sum = quadrics[from];
+    sum.add(quadrics[to]);
+    return sum.evaluate(positions[to]);
+}
+
+float cg::world::mesh_simplifier::get_distance(unsigned int from, unsigned int to) const
+{
+    quadric sum = quadrics[from];
+    if (from != to) {
+        sum.add(quadrics[to]);
+    }
+    if (sum.planes == 0) {
+        return 0.f;
+    }
+    return static_cast<float>(std::sqrt(sum.evaluate(positions[to]) / sum.planes));
+}
+
+unsigned int cg::world::mesh_simplifier::get_next_corner(size_t triangle_id, unsigned int vertex) const
+{
+    const unsigned int* triangle = &indexes[triangle_id * 3];
+    return triangle[0] == vertex ? triangle[1] : triangle[1] == vertex ? triangle[2] : triangle[0];
+}
+
+void cg::world::mesh_simplifier::get_collapses(unsigned int vertex)
+{
+    // Around a vertex that is not locked, every neighbor follows it in one triangle
+    auto& result = candidates;
+    result.clear();
+    for (size_t triangle_id : vertex_triangles[vertex]) {
+        unsigned int to = get_next_corner(triangle_id, vertex);
+        result.push_back({ get_cost(vertex, to), vertex, to });
+    }
+    std::sort(result.begin(), result.end(), [](const collapse& a, const collapse& b) {
+        return a.cost < b.cost || (a.cost == b.cost && a.to < b.to);
+    });
+    result.erase(std::unique(result.begin(), result.end(), [](const collapse& a, const collapse& b) {
+        return a.to == b.to;
+    }), result.end());
+}
+
+void cg::world::mesh_simplifier::queue_vertex(unsigned int vertex)
+{
+    ++versions[vertex];
+    queued_costs[vertex] = DBL_MAX;
+    if (locked[vertex] || vertex_triangles[vertex].empty()) {
+        return;
+    }
+    double cost = DBL_MAX;
+    for (size_t triangle_id : vertex_triangles[vertex]) {
+        cost = std::min(cost, get_cost(vertex, get_next_corner(triangle_id, vertex)));
+    }
+    queue.push({ cost, vertex, versions[vertex] });
+    queued_costs[vertex] = cost;
+}
+
+bool cg::world::mesh_simplifier::can_collapse(unsigned int from, unsigned int to)
+{
+    // Link condition: the vertices next to both ends are exactly the third corners
+    // of the triangles on the edge, otherwise the collapse pinches the surface
+    uint32_t from_mark = ++mark;
+    for (size_t triangle_id : vertex_triangles[from]) {
+        for (size_t i = 0; i < 3; ++i) {
+            marks[indexes[triangle_id * 3 + i]] = from_mark;
+        }
+    }
+    size_t edge_triangles = 0;
+    for (size_t triangle_id : vertex_triangles[to]) {
+        const unsigned int* triangle = &indexes[triangle_id * 3];
+        if (triangle[0] == from || triangle[1] == from || triangle[2] == from) {
+            ++edge_triangles;
+        }
+    }
+    if (edge_triangles == 0) {
+        return false;
+    }
+    size_t shared_neighbors = 0;
+    uint32_t shared_mark = ++mark;
+    for (size_t triangle_id : vertex_triangles[to]) {
+        for (size_t i = 0; i < 3; ++i) {
+            unsigned int vertex_id = indexes[triangle_id * 3 + i];
+            if (vertex_id != from && vertex_id != to && marks[vertex_id] == from_mark) {
+                marks[vertex_id] = shared_mark;
+                ++shared_neighbors;
+            }
+        }
+    }
+    if (shared_neighbors != edge_triangles) {
+        return false;
+    }
+
+    // Triangles around the removed vertex must not flip
+    for (size_t triangle_id : vertex_triangles[from]) {
+        const unsigned int* triangle = &indexes[triangle_id * 3];
+        if (triangle[0] == to || triangle[1] == to || triangle[2] == to) {
+            continue;
+        }
+        float3 corners[3];
+        for (size_t i = 0; i < 3; ++i) {
+            corners[i] = triangle[i] == from ? positions[to] : positions[triangle[i]];
+        }
+        float3 before = face_normal(positions[triangle[0]], positions[triangle[1]], positions[triangle[2]]);
+        float3 after = face_normal(corners[0], corners[1], corners[2]);
+        if (dot(before, after) <= 0.f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void cg::world::mesh_simplifier::apply_collapse(unsigned int from, unsigned int to)
+{
+    quadrics[to].add(quadrics[from]);
+
+    moved.clear();
+    for (size_t triangle_id : vertex_triangles[from]) {
+        unsigned int* triangle = &indexes[triangle_id * 3];
+        if (triangle[0] == to || triangle[1] == to || triangle[2] == to) {
+            removed[triangle_id] = true;
+            --num_triangles_left;
+            for (size_t i = 0; i < 3; ++i) {
+                if (triangle[i] != from) {
+                    auto& triangles = vertex_triangles[triangle[i]];
+                    triangles.erase(std::find(triangles.begin(), triangles.end(), triangle_id));
+                }
+            }
+            continue;
+        }
+        for (size_t i = 0; i < 3; ++i) {
+            if (triangle[i] == from) {
+                triangle[i] = to;
+            }
+        }
+        vertex_triangles[to].push_back(triangle_id);
+        moved.push_back(triangle_id);
+    }
+    vertex_triangles[from].clear();
+
+    error = std::max(error, get_distance(to, to));
+
+    // Quadrics only grow, so queued costs stay lower bounds except for new edges:
+    // to has new edges all around, the corners of the moved triangles one to to.
+    // Vertices out of the queue get another chance in their changed neighborhood
+    queue_vertex(to);
+    for (size_t triangle_id : moved) {
+        for (size_t i = 0; i < 3; ++i) {
+            unsigned int vertex_id = indexes[triangle_id * 3 + i];
+            if (vertex_id == to || locked[vertex_id]) {
+                continue;
+            }
+            if (queued_costs[vertex_id] == DBL_MAX) {
+                queue_vertex(vertex_id);
+                continue;
+            }
+            double cost = get_cost(vertex_id, to);
+            if (cost < queued_costs[vertex_id]) {
+                queue.push({ cost, vertex_id, ++versions[vertex_id] });
+                queued_costs[vertex_id] = cost;
+            }
+        }
+    }
+}
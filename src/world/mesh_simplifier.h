@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <linalg.h>
+#include <queue>
+#include <vector>
+
+
+using namespace linalg::aliases;
+
+namespace cg::world
+{
+    // Quadric error metric edge collapse (Garland-Heckbert), restricted to half-edge
+    // collapses so every level indexes the same vertices. Border and seam vertices
+    // (a position shared by several vertices) stay in place to keep shapes watertight.
+    // Vertices collapse cheapest first through a priority queue, and quadrics add up
+    // over the collapses, so each call to simplify continues from the last one and
+    // every level is measured against the input mesh
+    class mesh_simplifier
+    {
+    public:
+        mesh_simplifier(const std::vector<float3>& in_positions, const std::vector<unsigned int>& in_indexes);
+
+        // Collapses edges until target_triangles are left or nothing more can collapse
+        // without moving the surface further than target_error, returns the triangles
+        // left in input order
+        std::vector<unsigned int> simplify(size_t target_triangles, float target_error);
+        // Largest root mean square distance of a kept vertex to the input triangles
+        // collapsed into it, a bound of how far a level strays from the input
+        float get_error() const;
+
+    protected:
+        // Symmetric 4x4 matrix of the sum of squared distances to a set of planes
+        struct quadric
+        {
+            double a00 = 0, a01 = 0, a02 = 0, a11 = 0, a12 = 0, a22 = 0;
+            double b0 = 0, b1 = 0, b2 = 0;
+            double c = 0;
+            double planes = 0;
+
+            void add_plane(const float3& normal, float distance);
+            void add(const quadric& other);
+            double evaluate(const float3& p) const;
+        };
+
+        // Moves from onto to
+        struct collapse
+        {
+            double cost;
+            unsigned int from;
+            unsigned int to;
+        };
+        // Cost of the cheapest collapse of vertex at the time it was queued. The entry
+        // is stale once version is not that of the vertex any more
+        struct queued_vertex
+        {
+            double cost;
+            unsigned int vertex;
+            uint32_t version;
+
+            bool operator>(const queued_vertex& other) const { return cost > other.cost; }
+        };
+
+        std::vector<float3> positions;
+        std::vector<unsigned int> indexes;
+        std::vector<bool> removed;
+        size_t num_triangles_left;
+
+        std::vector<quadric> quadrics;
+        std::vector<std::vector<size_t>> vertex_triangles;
+        std::vector<bool> locked;
+        std::vector<uint32_t> versions;
+        // Cost each vertex is queued at, DBL_MAX for vertices out of the queue
+        std::vector<double> queued_costs;
+        std::priority_queue<queued_vertex, std::vector<queued_vertex>, std::greater<queued_vertex>> queue;
+
+        float error = 0.f;
+
+        // Scratch marks of neighborhood tests, a vertex is marked when it holds mark
+        std::vector<uint32_t> marks;
+        uint32_t mark = 0;
+        // Scratch lists of collapses and moved triangles
+        std::vector<collapse> candidates;
+        std::vector<size_t> moved;
+
+        double get_cost(unsigned int from, unsigned int to) const;
+        unsigned int get_next_corner(size_t triangle_id, unsigned int vertex) const;
+        // Root mean square distance from to to the input triangles merged into both ends
+        float get_distance(unsigned int from, unsigned int to) const;
+        // Fills candidates with collapses of vertex onto each of its neighbors, cheapest first
+        void get_collapses(unsigned int vertex);
+        void queue_vertex(unsigned int vertex);
+        // Keeps the surface manifold and the triangles around from unflipped
+        bool can_collapse(unsigned int from, unsigned int to);
+        void apply_collapse(unsigned int from, unsigned int to);
+    };
+}// namespace cg::world
@@ -2,8 +2,12 @@
 
 #include "model.h"
 
+#include "mesh_simplifier.h"
 #include "utils/error_handler.h"
 
+#include <algorithm>
+#include <cfloat>
+#include <climits>
 #include <linalg.h>
 
 
@@ -34,6 +38,9 @@ void cg::world::model::load_obj(const std::filesystem::path& model_path)
 
     size_t shape_id = 0;
     textures.resize(shapes.size());
+    bounding_boxes.resize(shapes.size());
+    bounding_spheres.resize(shapes.size());
+    lods.resize(shapes.size());
 
     for (const auto& shape : shapes) {
         const auto& mesh = shape.mesh;
@@ -85,6 +92,10 @@ void cg::world::model::load_obj(const std::filesystem::path& model_path)
 
         auto vertex_buffer = vertex_buffers[shape_id];
         auto index_buffer  = index_buffers[shape_id];
+        auto& bounding_box = bounding_boxes[shape_id];
+
+        bounding_box.min = float3{ FLT_MAX, FLT_MAX, FLT_MAX };
+        bounding_box.max = float3{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
 
         std::map<tuple_int3, uint32_t> index_map;
 
@@ -127,6 +138,10 @@ void cg::world::model::load_obj(const std::filesystem::path& model_path)
                     vertex.y = attrib.vertices[3 * idx.vertex_index + 1];
                     vertex.z = attrib.vertices[3 * idx.vertex_index + 2];
 
+                    float3 position{ vertex.x, vertex.y, vertex.z };
+                    bounding_box.min = min(bounding_box.min, position);
+                    bounding_box.max = max(bounding_box.max, position);
+
                     if (idx.normal_index > -1) {
                         vertex.nx = attrib.normals[3 * idx.normal_index + 0];
                         vertex.ny = attrib.normals[3 * idx.normal_index + 1];
@@ -170,6 +185,25 @@ void cg::world::model::load_obj(const std::filesystem::path& model_path)
             }
             index_offset += fv;
         }
+
+        // Centered on the box, but the radius is taken from the vertices
+        // and so is usually tighter than half of the box diagonal
+        auto& bounding_sphere = bounding_spheres[shape_id];
+        bounding_sphere.center = (bounding_box.min + bounding_box.max) / 2.f;
+        bounding_sphere.radius = 0.f;
+        for (size_t i = 0; i < vertex_buffer->get_number_of_elements(); ++i) {
+            const auto& vertex = vertex_buffer->item(i);
+            bounding_sphere.radius = std::max(
+                bounding_sphere.radius,
+                length(float3{ vertex.x, vertex.y, vertex.z } - bounding_sphere.center)
+            );
+        }
+
+        lods[shape_id] = build_lods(vertex_buffer, index_buffer);
+        for (auto& level : lods[shape_id]) {
+            build_meshlets(vertex_buffer, level);
+        }
+        optimize_vertex_order(vertex_buffer, lods[shape_id]);
         ++shape_id;
     }
 }
@@ -193,6 +227,356 @@ cg::world::model::get_per_shape_texture_files() const
     return textures;
 }
 
+const std::vector<bounding_box>& cg::world::model::get_bounding_boxes() const
+{
+    return bounding_boxes;
+}
+
+const std::vector<bounding_sphere>& cg::world::model::get_bounding_spheres() const
+{
+    return bounding_spheres;
+}
+
+const std::vector<std::vector<lod>>& cg::world::model::get_lods() const
+{
+    return lods;
+}
+
+std::vector<lod> cg::world::model::build_lods(
+        const std::shared_ptr<cg::resource<cg::vertex>>& vertex_buffer,
+        const std::shared_ptr<cg::resource<unsigned int>>& index_buffer)
+{
+    std::vector<float3> positions(vertex_buffer->get_number_of_elements());
+    for (size_t i = 0; i < positions.size(); ++i) {
+        const auto& vertex = vertex_buffer->item(i);
+        positions[i] = float3{ vertex.x, vertex.y, vertex.z };
+    }
+    std::vector<unsigned int> indexes(index_buffer->get_number_of_elements());
+    float3 min_corner{ FLT_MAX, FLT_MAX, FLT_MAX };
+    float3 max_corner{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (size_t i = 0; i < indexes.size(); ++i) {
+        indexes[i] = index_buffer->item(i);
+        min_corner = min(min_corner, positions[indexes[i]]);
+        max_corner = max(max_corner, positions[indexes[i]]);
+    }
+    float target_error = indexes.empty() ? 0.f : max_lod_error * length(max_corner - min_corner);
+
+    // Every level halves the triangle count of the previous one, the chain ends
+    // when the simplifier gets stuck on locked vertices or on the error bound
+    std::vector<lod> result;
+    result.push_back({ index_buffer, {}, nullptr, nullptr, 0.f });
+    mesh_simplifier simplifier(positions, indexes);
+    while (result.size() < max_lods && indexes.size() / 3 > min_lod_triangles) {
+        auto simplified = simplifier.simplify(indexes.size() / 6, target_error);
+        if (simplified.size() > indexes.size() * 3 / 4) {
+            break;
+        }
+        indexes.swap(simplified);
+
+        auto lod_index_buffer = std::make_shared<cg::resource<unsigned int>>(indexes.size());
+        for (size_t i = 0; i < indexes.size(); ++i) {
+            lod_index_buffer->item(i) = indexes[i];
+        }
+        result.push_back({ lod_index_buffer, {}, nullptr, nullptr, simplifier.get_error() });
+    }
+    return result;
+}
+
+void cg::world::model::build_meshlets(
+        const std::shared_ptr<cg::resource<cg::vertex>>& vertex_buffer, lod& level)
+{
+    auto& index_buffer = level.index_buffer;
+    size_t num_vertices  = vertex_buffer->get_number_of_elements();
+    size_t num_triangles = index_buffer->get_number_of_elements() / 3;
+
+    auto get_position = [&](unsigned int vertex_id) {
+        const auto& vertex = vertex_buffer->item(vertex_id);
+        return float3{ vertex.x, vertex.y, vertex.z };
+    };
+
+    std::vector<std::vector<size_t>> vertex_triangles(num_vertices);
+    std::vector<float3> triangle_centers(num_triangles);
+    for (size_t triangle_id = 0; triangle_id < num_triangles; ++triangle_id) {
+        float3 center{ 0, 0, 0 };
+        for (size_t i = 0; i < 3; ++i) {
+            unsigned int vertex_id = index_buffer->item(triangle_id * 3 + i);
+            vertex_triangles[vertex_id].push_back(triangle_id);
+            center += get_position(vertex_id);
+        }
+        triangle_centers[triangle_id] = center / 3.f;
+    }
+
+    // Triangle centers bucketed in a grid of about one triangle per cell, to find the
+    // nearest triangle left once a meshlet has no adjacent one that fits
+    float3 grid_min{ FLT_MAX, FLT_MAX, FLT_MAX };
+    float3 grid_max{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (const auto& center : triangle_centers) {
+        grid_min = min(grid_min, center);
+        grid_max = max(grid_max, center);
+    }
+    float grid_extent = maxelem(grid_max - grid_min);
+    float cell_size = grid_extent > 0.f ?
+        grid_extent / std::max(std::cbrt(static_cast<float>(num_triangles)), 1.f) : 1.f;
+    auto to_cells = [&](const float3& offset) {
+        return int3{
+            static_cast<int>(offset.x / cell_size),
+            static_cast<int>(offset.y / cell_size),
+            static_cast<int>(offset.z / cell_size)
+        };
+    };
+    int3 grid_size{ 1, 1, 1 };
+    if (num_triangles > 0) {
+        grid_size = to_cells(grid_max - grid_min) + 1;
+    }
+    auto get_cell = [&](const float3& position) {
+        return min(max(to_cells(position - grid_min), int3{ 0, 0, 0 }), grid_size - 1);
+    };
+    auto get_cell_id = [&](const int3& cell) {
+        return (static_cast<size_t>(cell.z) * grid_size.y + cell.y) * grid_size.x + cell.x;
+    };
+    std::vector<std::vector<size_t>> grid_cells(static_cast<size_t>(grid_size.x) * grid_size.y * grid_size.z);
+    for (size_t triangle_id = 0; triangle_id < num_triangles; ++triangle_id) {
+        grid_cells[get_cell_id(get_cell(triangle_centers[triangle_id]))].push_back(triangle_id);
+    }
+
+    // Meshlets grow greedily over shared vertices: the next triangle adds the fewest
+    // new vertices, ties go to the one closest to the meshlet center
+    std::vector<meshlet> result;
+    std::vector<size_t> triangle_order;
+    std::vector<bool> emitted(num_triangles, false);
+    std::vector<size_t> vertex_owner(num_vertices, SIZE_MAX);
+    std::vector<size_t> frontier_owner(num_triangles, SIZE_MAX);
+    std::vector<unsigned int> meshlet_vertices;
+    // Triangles left next to the meshlet, the only ones the meshlet can grow over
+    std::vector<size_t> frontier;
+    std::vector<unsigned int> vertex_list;
+    size_t seed = 0;
+    while (triangle_order.size() < num_triangles) {
+        while (emitted[seed]) {
+            ++seed;
+        }
+
+        size_t meshlet_id = result.size();
+        meshlet cluster{};
+        cluster.index_offset = triangle_order.size() * 3;
+        meshlet_vertices.clear();
+        frontier.clear();
+        float3 center_sum{ 0, 0, 0 };
+
+        auto count_new_vertices = [&](size_t triangle_id) {
+            size_t new_vertices = 0;
+            for (size_t i = 0; i < 3; ++i) {
+                if (vertex_owner[index_buffer->item(triangle_id * 3 + i)] != meshlet_id) {
+                    ++new_vertices;
+                }
+            }
+            return new_vertices;
+        };
+
+        size_t candidate = seed;
+        while (true) {
+            emitted[candidate] = true;
+            triangle_order.push_back(candidate);
+            cluster.index_count += 3;
+            center_sum += triangle_centers[candidate];
+            for (size_t i = 0; i < 3; ++i) {
+                unsigned int vertex_id = index_buffer->item(candidate * 3 + i);
+                if (vertex_owner[vertex_id] != meshlet_id) {
+                    vertex_owner[vertex_id] = meshlet_id;
+                    meshlet_vertices.push_back(vertex_id);
+                    for (size_t triangle_id : vertex_triangles[vertex_id]) {
+                        if (!emitted[triangle_id] && frontier_owner[triangle_id] != meshlet_id) {
+                            frontier_owner[triangle_id] = meshlet_id;
+                            frontier.push_back(triangle_id);
+                        }
+                    }
+                }
+            }
+            if (cluster.index_count / 3 == meshlet::max_triangles) {
+                break;
+            }
+
+            float3 center = center_sum / static_cast<float>(cluster.index_count / 3);
+            size_t best_new_vertices = 4;
+            float best_distance = FLT_MAX;
+            for (size_t i = 0; i < frontier.size();) {
+                size_t triangle_id = frontier[i];
+                if (emitted[triangle_id]) {
+                    frontier[i] = frontier.back();
+                    frontier.pop_back();
+                    continue;
+                }
+                ++i;
+                size_t new_vertices = count_new_vertices(triangle_id);
+                if (meshlet_vertices.size() + new_vertices > meshlet::max_vertices) {
+                    continue;
+                }
+                float distance = length(triangle_centers[triangle_id] - center);
+                if (new_vertices < best_new_vertices ||
+                    (new_vertices == best_new_vertices && distance < best_distance)) {
+                    best_new_vertices = new_vertices;
+                    best_distance = distance;
+                    candidate = triangle_id;
+                }
+            }
+            if (best_new_vertices == 4 && triangle_order.size() < num_triangles &&
+                meshlet_vertices.size() + 3 <= meshlet::max_vertices) {
+                // Nothing adjacent fits: the nearest triangle left by center, searched in
+                // shells of cells around the meshlet center until no closer one can exist.
+                // Emitted triangles are dropped from the cells on the way
+                int3 center_cell = get_cell(center);
+                int max_shell = maxelem(grid_size);
+                for (int shell = 0; shell <= max_shell; ++shell) {
+                    int3 first = max(center_cell - shell, int3{ 0, 0, 0 });
+                    int3 last = min(center_cell + shell, grid_size - 1);
+                    for (int z = first.z; z <= last.z; ++z) {
+                        for (int y = first.y; y <= last.y; ++y) {
+                            for (int x = first.x; x <= last.x; ++x) {
+                                if (maxelem(abs(int3{ x, y, z } - center_cell)) != shell) {
+                                    continue;
+                                }
+                                auto& cell = grid_cells[get_cell_id(int3{ x, y, z })];
+                                for (size_t i = 0; i < cell.size();) {
+                                    if (emitted[cell[i]]) {
+                                        cell[i] = cell.back();
+                                        cell.pop_back();
+                                        continue;
+                                    }
+                                    float distance = length(triangle_centers[cell[i]] - center);
+                                    if (distance < best_distance) {
+                                        best_new_vertices = 3;
+                                        best_distance = distance;
+                                        candidate = cell[i];
+                                    }
+                                    ++i;
+                                }
+                            }
+                        }
+                    }
+                    // Cells of the next shell are at least shell cells away from the center
+                    if (best_new_vertices == 3 && best_distance <= shell * cell_size) {
+                        break;
+                    }
+                }
+            }
+            if (best_new_vertices == 4) {
+                break;
+            }
+        }
+        cluster.vertex_offset = vertex_list.size();
+        cluster.vertex_count = meshlet_vertices.size();
+        vertex_list.insert(vertex_list.end(), meshlet_vertices.begin(), meshlet_vertices.end());
+        result.push_back(cluster);
+    }
+
+    std::vector<unsigned int> indexes(index_buffer->get_number_of_elements());
+    for (size_t i = 0; i < indexes.size(); ++i) {
+        indexes[i] = index_buffer->item(i);
+    }
+    for (size_t i = 0; i < triangle_order.size() * 3; ++i) {
+        index_buffer->item(i) = indexes[triangle_order[i / 3] * 3 + i % 3];
+    }
+
+    level.meshlet_vertices = std::make_shared<cg::resource<unsigned int>>(vertex_list.size());
+    level.meshlet_indexes = std::make_shared<cg::resource<unsigned int>>(index_buffer->get_number_of_elements());
+    std::vector<unsigned int> list_positions(num_vertices);
+    for (const auto& cluster : result) {
+        for (size_t i = cluster.vertex_offset; i < cluster.vertex_offset + cluster.vertex_count; ++i) {
+            level.meshlet_vertices->item(i) = vertex_list[i];
+            list_positions[vertex_list[i]] = static_cast<unsigned int>(i);
+        }
+        for (size_t i = cluster.index_offset; i < cluster.index_offset + cluster.index_count; ++i) {
+            level.meshlet_indexes->item(i) = list_positions[index_buffer->item(i)];
+        }
+    }
+
+    for (auto& cluster : result) {
+        size_t index_end = cluster.index_offset + cluster.index_count;
+
+        float3 box_min{ FLT_MAX, FLT_MAX, FLT_MAX };
+        float3 box_max{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        for (size_t i = cluster.index_offset; i < index_end; ++i) {
+            box_min = min(box_min, get_position(index_buffer->item(i)));
+            box_max = max(box_max, get_position(index_buffer->item(i)));
+        }
+        cluster.sphere.center = (box_min + box_max) / 2.f;
+        for (size_t i = cluster.index_offset; i < index_end; ++i) {
+            cluster.sphere.radius = std::max(
+                cluster.sphere.radius,
+                length(get_position(index_buffer->item(i)) - cluster.sphere.center)
+            );
+        }
+
+        // The cone is built from the winding, as that is what face culling looks at
+        std::vector<float3> normals;
+        float3 normal_sum{ 0, 0, 0 };
+        for (size_t i = cluster.index_offset; i < index_end; i += 3) {
+            float3 a = get_position(index_buffer->item(i));
+            float3 normal = cross(
+                get_position(index_buffer->item(i + 1)) - a,
+                get_position(index_buffer->item(i + 2)) - a
+            );
+            if (length(normal) > 0.f) {
+                normals.push_back(normalize(normal));
+                normal_sum += normals.back();
+            }
+        }
+        cluster.cone.cutoff = 1.f;
+        if (length(normal_sum) > 0.f) {
+            cluster.cone.axis = normalize(normal_sum);
+            float min_dot = 1.f;
+            for (const auto& normal : normals) {
+                min_dot = std::min(min_dot, dot(normal, cluster.cone.axis));
+            }
+            if (min_dot > 0.f) {
+                cluster.cone.cutoff = std::sqrt(1.f - min_dot * min_dot);
+            }
+        }
+    }
+    level.meshlets = std::move(result);
+}
+
+void cg::world::model::optimize_vertex_order(
+        const std::shared_ptr<cg::resource<cg::vertex>>& vertex_buffer,
+        std::vector<lod>& shape_lods)
+{
+    // Renumbered level by level from the coarsest, by first use in its meshlets.
+    // Collapses keep vertices in place, so every level uses the vertices of the
+    // coarser ones and a compact range at the start of the buffer
+    size_t num_vertices = vertex_buffer->get_number_of_elements();
+    std::vector<cg::vertex> vertices(num_vertices);
+    for (size_t i = 0; i < num_vertices; ++i) {
+        vertices[i] = vertex_buffer->item(i);
+    }
+
+    std::vector<unsigned int> remap(num_vertices, UINT_MAX);
+    unsigned int next_vertex_id = 0;
+    auto renumber = [&](unsigned int vertex_id) {
+        if (remap[vertex_id] == UINT_MAX) {
+            remap[vertex_id] = next_vertex_id;
+            vertex_buffer->item(next_vertex_id) = vertices[vertex_id];
+            ++next_vertex_id;
+        }
+    };
+    for (auto level = shape_lods.rbegin(); level != shape_lods.rend(); ++level) {
+        for (size_t i = 0; i < level->index_buffer->get_number_of_elements(); ++i) {
+            renumber(level->index_buffer->item(i));
+        }
+    }
+    for (unsigned int vertex_id = 0; vertex_id < num_vertices; ++vertex_id) {
+        renumber(vertex_id);
+    }
+
+    for (auto& level : shape_lods) {
+        for (size_t i = 0; i < level.index_buffer->get_number_of_elements(); ++i) {
+            level.index_buffer->item(i) = remap[level.index_buffer->item(i)];
+        }
+        for (size_t i = 0; i < level.meshlet_vertices->get_number_of_elements(); ++i) {
+            level.meshlet_vertices->item(i) = remap[level.meshlet_vertices->item(i)];
+        }
+    }
+}
+
 
 const float4x4 cg::world::model::get_world_matrix() const
 {
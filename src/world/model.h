@@ -1,6 +1,7 @@
 #pragma once
 
 #include "resource.h"
+#include "world/bounds.h"
 
 #include <filesystem>
 #include <linalg.h>
@@ -11,6 +12,20 @@ using namespace linalg::aliases;
 
 namespace cg::world
 {
+    // One level of detail of a shape, all levels index the same vertex buffer and
+    // each one a range at its start
+    struct lod
+    {
+        std::shared_ptr<cg::resource<unsigned int>> index_buffer;
+        std::vector<meshlet> meshlets;
+        // Vertex ids of every meshlet in turn, and index_buffer renumbered into positions
+        // in that list: a meshlet draw shades each of its vertices exactly once
+        std::shared_ptr<cg::resource<unsigned int>> meshlet_vertices;
+        std::shared_ptr<cg::resource<unsigned int>> meshlet_indexes;
+        // Model space distance to the full detail surface
+        float error;
+    };
+
     class model
     {
     public:
@@ -25,6 +40,11 @@ namespace cg::world
 
         std::vector<std::filesystem::path> get_per_shape_texture_files() const;
 
+        const std::vector<bounding_box>& get_bounding_boxes() const;
+        const std::vector<bounding_sphere>& get_bounding_spheres() const;
+        // Per shape, from full detail (same index buffer as get_index_buffers) to coarsest
+        const std::vector<std::vector<lod>>& get_lods() const;
+
         const float4x4 get_world_matrix() const;
 
     protected:
@@ -37,5 +57,24 @@ namespace cg::world
         std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
 
         std::vector<std::filesystem::path> textures;
+
+        std::vector<bounding_box> bounding_boxes;
+        std::vector<bounding_sphere> bounding_spheres;
+        std::vector<std::vector<lod>> lods;
+
+        static constexpr size_t max_lods = 8;
+        static constexpr size_t min_lod_triangles = 64;
+        // Farthest a level may stray from the input, relative to the shape size
+        static constexpr float max_lod_error = 0.02f;
+
+        static std::vector<lod> build_lods(
+                const std::shared_ptr<cg::resource<cg::vertex>>& vertex_buffer,
+                const std::shared_ptr<cg::resource<unsigned int>>& index_buffer);
+        // Reorders the triangles of the level by meshlet and fills its meshlet buffers
+        static void build_meshlets(
+                const std::shared_ptr<cg::resource<cg::vertex>>& vertex_buffer, lod& level);
+        static void optimize_vertex_order(
+                const std::shared_ptr<cg::resource<cg::vertex>>& vertex_buffer,
+                std::vector<lod>& shape_lods);
     };
 }// namespace cg::world
\ No newline at end of file